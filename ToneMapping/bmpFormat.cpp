@@ -0,0 +1,215 @@
+#include <iostream>
+#include <cstring>
+#include "tone.h"
+
+// Input format layer. Every mapping path works on 24-bit bottom-up BGR rows; 32-bit BGRA/BGRX,
+// BI_BITFIELDS and top-down files are converted row by row as they are read. The row loops are
+// templates instantiated once per layout and the layout switch sits outside them, so the 24-bit
+// path runs the same loop as before and the other layouts pay no per-pixel branch on the format.
+
+static const uint32_t BI_RGB = 0;
+static const uint32_t BI_BITFIELDS = 3;
+static const uint32_t BI_ALPHABITFIELDS = 6;
+
+// Channel masks of a 32-bit BGRA pixel, the layout BI_BITFIELDS files use almost always.
+static const uint32_t BGRA_MASKS[3] = {0x00FF0000, 0x0000FF00, 0x000000FF};
+
+static void setMask(BMPFormat& format, int channel, uint32_t mask){
+    int shift = 0;
+    int bits = 0;
+    if(mask != 0){
+        while(((mask >> shift) & 1) == 0)
+            shift++;
+        while(shift + bits < 32 && ((mask >> (shift + bits)) & 1) != 0)
+            bits++;
+    }
+    if(bits == 0 || (mask >> shift) != ((1ull << bits) - 1)){
+        std::cerr << "Error: Unsupported BMP channel mask 0x" << std::hex << mask << std::dec << std::endl;
+        exit(1);
+    }
+
+    format.masks[channel] = mask;
+    format.shifts[channel] = shift;
+    format.maxValues[channel] = (uint32_t)((1ull << bits) - 1);
+}
+
+BMPFormat bmpFormat(const BMPInfoHeader& bmpInfo, const uint8_t* maskBytes){
+    if(bmpInfo.headerSize < 40 || bmpInfo.width <= 0 || bmpInfo.height == 0 || bmpInfo.height == INT32_MIN){
+        std::cerr << "Error: Unsupported BMP dimensions " << bmpInfo.width << "x" << bmpInfo.height << std::endl;
+        exit(1);
+    }
+
+    BMPFormat format;
+    format.width = bmpInfo.width;
+    format.height = bmpInfo.height < 0 ? -bmpInfo.height : bmpInfo.height;
+    format.topDown = bmpInfo.height < 0;
+    format.bytesPerPixel = bmpInfo.bitCount / 8;
+    format.srcStride = (((size_t)bmpInfo.width * bmpInfo.bitCount + 31) / 32) * 4;
+    for(int c = 0; c < 3; c++){
+        format.masks[c] = BGRA_MASKS[c];
+        format.shifts[c] = 16 - 8 * c;
+        format.maxValues[c] = 255;
+    }
+
+    bool bitfields = bmpInfo.compression == BI_BITFIELDS || bmpInfo.compression == BI_ALPHABITFIELDS;
+
+    if(bmpInfo.bitCount == 24 && bmpInfo.compression == BI_RGB)
+        format.layout = LAYOUT_BGR24;
+    else if(bmpInfo.bitCount == 32 && bmpInfo.compression == BI_RGB)
+        format.layout = LAYOUT_BGRX32;
+    else if(bmpInfo.bitCount == 32 && bitfields){
+        // The masks follow the 40-byte info header, which is also where V2-V5 headers keep them.
+        uint32_t masks[3];
+        memcpy(masks, maskBytes, sizeof(masks));
+        for(int c = 0; c < 3; c++){
+            setMask(format, c, masks[c]);
+        }
+        bool bgra = memcmp(masks, BGRA_MASKS, sizeof(masks)) == 0;
+        format.layout = bgra ? LAYOUT_BGRX32 : LAYOUT_MASKED32;
+    }
+    else {
+        std::cerr << "Error: Unsupported BMP format (" << bmpInfo.bitCount << "-bit, compression "
+                  << bmpInfo.compression << ")" << std::endl;
+        exit(1);
+    }
+
+    return format;
+}
+
+// Reads the BI_BITFIELDS masks if there are any. Leaves the stream position undefined.
+BMPFormat readBMPFormat(std::istream& readBMP, const BMPInfoHeader& bmpInfo){
+    uint8_t maskBytes[BMP_MASKS_SIZE] = {0};
+
+    if(bmpInfo.compression == BI_BITFIELDS || bmpInfo.compression == BI_ALPHABITFIELDS){
+        readBMP.clear();
+        readBMP.seekg(BMP_HEADER_SIZE, std::ios::beg);
+        readBMP.read(reinterpret_cast<char*>(maskBytes), BMP_MASKS_SIZE);
+        if(!readBMP){
+            std::cerr << "Error: Missing BMP channel masks" << std::endl;
+            exit(1);
+        }
+    }
+    return bmpFormat(bmpInfo, maskBytes);
+}
+
+// Header of the 24-bit bottom-up file every path writes.
+BMPInfoHeader outputInfoHeader(const BMPInfoHeader& bmpInfo){
+    BMPInfoHeader outInfo = bmpInfo;
+    outInfo.headerSize = 40;
+    outInfo.height = bmpInfo.height < 0 ? -bmpInfo.height : bmpInfo.height;
+    outInfo.planes = 1;
+    outInfo.bitCount = 24;
+    outInfo.compression = BI_RGB;
+    outInfo.imageSize = bmpRowStride(outInfo.width) * outInfo.height;
+    outInfo.colorsUsed = 0;
+    outInfo.colorsImportant = 0;
+    return outInfo;
+}
+
+static inline uint8_t maskedChannel(uint32_t value, const BMPFormat& format, int c){
+    uint32_t channel = (value & format.masks[c]) >> format.shifts[c];
+    uint32_t maxValue = format.maxValues[c];
+    if(maxValue >= 255)
+        return (uint8_t)(channel >> (32 - __builtin_clz(maxValue) - 8));
+    return (uint8_t)((channel * 255 + maxValue / 2) / maxValue);
+}
+
+// Reads one pixel of layout L as 8-bit B, G, R.
+template<BMPLayout L>
+static inline void loadPixel(const uint8_t* src, const BMPFormat& format, uint8_t* bgr);
+
+template<>
+inline void loadPixel<LAYOUT_BGR24>(const uint8_t* src, const BMPFormat&, uint8_t* bgr){
+    bgr[0] = src[0];
+    bgr[1] = src[1];
+    bgr[2] = src[2];
+}
+
+template<>
+inline void loadPixel<LAYOUT_BGRX32>(const uint8_t* src, const BMPFormat&, uint8_t* bgr){
+    bgr[0] = src[0];
+    bgr[1] = src[1];
+    bgr[2] = src[2];
+}
+
+template<>
+inline void loadPixel<LAYOUT_MASKED32>(const uint8_t* src, const BMPFormat& format, uint8_t* bgr){
+    uint32_t value;
+    memcpy(&value, src, 4);
+    bgr[0] = maskedChannel(value, format, 2);
+    bgr[1] = maskedChannel(value, format, 1);
+    bgr[2] = maskedChannel(value, format, 0);
+}
+
+// File row k of src goes to row k of dst, or row rows - 1 - k for top-down files.
+static inline size_t destinationRow(const BMPFormat& format, int k, int rows){
+    return format.topDown ? rows - 1 - k : k;
+}
+
+template<BMPLayout L>
+static void convertRows(const BMPFormat& format, const uint8_t* src, int rows, uint8_t* dst, size_t dstStride){
+    const int bytesPerPixel = L == LAYOUT_BGR24 ? 3 : 4;
+
+    for(int k = 0; k < rows; k++){
+        const uint8_t* in = src + k * format.srcStride;
+        uint8_t* out = dst + destinationRow(format, k, rows) * dstStride;
+        for(int j = 0; j < format.width; j++){
+            loadPixel<L>(in, format, out);
+            in += bytesPerPixel;
+            out += 3;
+        }
+    }
+}
+
+template<BMPLayout L>
+static void decodeRowsPlanar(const BMPFormat& format, const uint8_t* src, int rows, PlanarImage& output, int firstRow){
+    const int bytesPerPixel = L == LAYOUT_BGR24 ? 3 : 4;
+    const float* normalize = normalizationLUT();
+
+    for(int k = 0; k < rows; k++){
+        const uint8_t* in = src + k * format.srcStride;
+        size_t out = (firstRow + destinationRow(format, k, rows)) * (size_t)format.width;
+        for(int j = 0; j < format.width; j++){
+            uint8_t bgr[3];
+            loadPixel<L>(in, format, bgr);
+            output.b[out] = normalize[bgr[0]];
+            output.g[out] = normalize[bgr[1]];
+            output.r[out] = normalize[bgr[2]];
+            in += bytesPerPixel;
+            out++;
+        }
+    }
+}
+
+void convertBMPRows(const BMPFormat& format, const uint8_t* src, int rows, uint8_t* dst, size_t dstStride){
+    switch(format.layout){
+        case LAYOUT_BGR24:
+            convertRows<LAYOUT_BGR24>(format, src, rows, dst, dstStride);
+            break;
+        case LAYOUT_BGRX32:
+            convertRows<LAYOUT_BGRX32>(format, src, rows, dst, dstStride);
+            break;
+        case LAYOUT_MASKED32:
+            convertRows<LAYOUT_MASKED32>(format, src, rows, dst, dstStride);
+            break;
+    }
+}
+
+void decodeBMPRows(const BMPFormat& format, const uint8_t* src, int rows, PlanarImage& output, int firstRow){
+    switch(format.layout){
+        case LAYOUT_BGR24:
+            decodeRowsPlanar<LAYOUT_BGR24>(format, src, rows, output, firstRow);
+            break;
+        case LAYOUT_BGRX32:
+            decodeRowsPlanar<LAYOUT_BGRX32>(format, src, rows, output, firstRow);
+            break;
+        case LAYOUT_MASKED32:
+            decodeRowsPlanar<LAYOUT_MASKED32>(format, src, rows, output, firstRow);
+            break;
+    }
+}
+
+// Output rows [startRow, endRow) as a range of file rows, for paths that read part of the image.
+int firstFileRow(const BMPFormat& format, int startRow, int endRow){
+    return format.topDown ? format.height - endRow : startRow;
+}
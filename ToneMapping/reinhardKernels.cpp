@@ -0,0 +1,333 @@
+#include <immintrin.h>
+#include <algorithm>
+#include "tone.h"
+
+// Reinhard mapping + denormalization kernels. All of them turn count pixels from the R, G, B planes
+// of a PlanarImage into RGB, the SIMD ones process 8 pixels per iteration and hand the tail to the
+// scalar kernel.
+//
+// Per pixel the scalar path computes c * (L_mapped / L) with L_mapped = sL / (1 + sL), s = a / avgLum.
+// The SIMD paths use the equivalent c * s / (1 + sL), so one reciprocal replaces the three divisions,
+// and narrow to bytes with saturating packs. Results match the scalar kernel within 1 LSB.
+//
+// With --srgb (outputEncodeLUT() not null) every kernel scales to SRGB_ENCODE_SIZE - 1 instead of 255
+// and looks the output bytes up in the encode table: a gather on AVX2, four scalar loads on SSE4.1.
+//
+// --deterministic selects the exact kernels instead. They compute c * s * maxOutput / (1 + sL) with a
+// real division, whose result IEEE 754 fixes, where rcpps is only an approximation that differs
+// between CPU vendors, and the scalar one (also used by the tails and processRows()) does the same
+// operations in the same order as the SIMD lanes, so all three give identical bytes.
+
+static ReinhardKernel selectedKernel = nullptr;
+
+void reinhardScalar(const float* r, const float* g, const float* b, RGB* output, size_t count, float avgLum, float exposureKey){
+    const int32_t* encode = outputEncodeLUT();
+    for(size_t i = 0; i < count; i++){
+        RGBf pixel = {r[i], g[i], b[i]};
+        RGBf mapped = toneMapReinhard(pixel, avgLum, exposureKey);
+        output[i] = encode ? toSRGBOutputPixel(mapped, encode) : toOutputPixel(mapped);
+    }
+}
+
+// Interleaves 8 pixels worth of 16-bit channel values into 24 bytes of R,G,B.
+__attribute__((target("sse4.1")))
+static inline void storeRGB8(uint8_t* out, __m128i r16, __m128i g16, __m128i b16){
+    __m128i rg = _mm_packus_epi16(r16, g16);   // r0..r7 g0..g7
+    __m128i bb = _mm_packus_epi16(b16, b16);   // b0..b7 b0..b7
+
+    const __m128i rgLow = _mm_setr_epi8(0, 8, -1, 1, 9, -1, 2, 10, -1, 3, 11, -1, 4, 12, -1, 5);
+    const __m128i bLow = _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1);
+    const __m128i rgHigh = _mm_setr_epi8(13, -1, 6, 14, -1, 7, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i bHigh = _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, -1, -1, -1, -1, -1, -1);
+
+    __m128i low = _mm_or_si128(_mm_shuffle_epi8(rg, rgLow), _mm_shuffle_epi8(bb, bLow));
+    __m128i high = _mm_or_si128(_mm_shuffle_epi8(rg, rgHigh), _mm_shuffle_epi8(bb, bHigh));
+
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out), low);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(out + 16), high);
+}
+
+// Reinhard scale factor times maxOutput for 4 pixels, zero where L < 1e-5.
+__attribute__((target("sse4.1")))
+static inline __m128 reinhardFactor4(__m128 L, __m128 scale, __m128 maxOutput){
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 two = _mm_set1_ps(2.0f);
+
+    __m128 denom = _mm_add_ps(one, _mm_mul_ps(scale, L));
+    __m128 rcp = _mm_rcp_ps(denom);
+    rcp = _mm_mul_ps(rcp, _mm_sub_ps(two, _mm_mul_ps(denom, rcp)));   // one Newton-Raphson step
+
+    __m128 factor = _mm_mul_ps(_mm_mul_ps(scale, rcp), maxOutput);
+    return _mm_and_ps(factor, _mm_cmpge_ps(L, _mm_set1_ps(1e-5f)));
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128i mapChannel4(__m128 channel, __m128 factor, __m128 maxOutput){
+    return _mm_cvttps_epi32(_mm_min_ps(_mm_mul_ps(channel, factor), maxOutput));
+}
+
+// No gather before AVX2: 8 pixels worth of 16-bit encode table indices go through memory and the
+// looked up bytes are written out directly, which beats lane extracts plus the shuffles of storeRGB8().
+__attribute__((target("sse4.1")))
+static inline void encodeRGB8(uint8_t* out, __m128i r16, __m128i g16, __m128i b16, const int32_t* encode){
+    alignas(16) uint16_t index[3][8];
+    _mm_store_si128(reinterpret_cast<__m128i*>(index[0]), r16);
+    _mm_store_si128(reinterpret_cast<__m128i*>(index[1]), g16);
+    _mm_store_si128(reinterpret_cast<__m128i*>(index[2]), b16);
+    for(int k = 0; k < 8; k++){
+        out[k * 3 + 0] = (uint8_t)encode[index[0][k]];
+        out[k * 3 + 1] = (uint8_t)encode[index[1][k]];
+        out[k * 3 + 2] = (uint8_t)encode[index[2][k]];
+    }
+}
+
+__attribute__((target("sse4.1")))
+void reinhardSSE41(const float* r, const float* g, const float* b, RGB* output, size_t count, float avgLum, float exposureKey){
+    uint8_t* out = reinterpret_cast<uint8_t*>(output);
+
+    const __m128 wr = _mm_set1_ps(LUMINANCE_WEIGHTS.r);
+    const __m128 wg = _mm_set1_ps(LUMINANCE_WEIGHTS.g);
+    const __m128 wb = _mm_set1_ps(LUMINANCE_WEIGHTS.b);
+    const __m128 scale = _mm_set1_ps(exposureKey / avgLum);
+    const int32_t* encode = outputEncodeLUT();
+    const __m128 maxOutput = _mm_set1_ps(encode ? SRGB_ENCODE_SIZE - 1 : 255.0f);
+
+    size_t i = 0;
+    for(; i + 8 <= count; i += 8){
+        __m128i r32[2], g32[2], b32[2];
+
+        for(int half = 0; half < 2; half++){
+            size_t j = i + half * 4;
+            __m128 rv = _mm_loadu_ps(r + j);
+            __m128 gv = _mm_loadu_ps(g + j);
+            __m128 bv = _mm_loadu_ps(b + j);
+
+            __m128 L = _mm_add_ps(_mm_add_ps(_mm_mul_ps(wr, rv), _mm_mul_ps(wg, gv)), _mm_mul_ps(wb, bv));
+            __m128 factor = reinhardFactor4(L, scale, maxOutput);
+
+            r32[half] = mapChannel4(rv, factor, maxOutput);
+            g32[half] = mapChannel4(gv, factor, maxOutput);
+            b32[half] = mapChannel4(bv, factor, maxOutput);
+        }
+
+        __m128i r16 = _mm_packus_epi32(r32[0], r32[1]);
+        __m128i g16 = _mm_packus_epi32(g32[0], g32[1]);
+        __m128i b16 = _mm_packus_epi32(b32[0], b32[1]);
+        if(encode)
+            encodeRGB8(out + i * 3, r16, g16, b16, encode);
+        else
+            storeRGB8(out + i * 3, r16, g16, b16);
+    }
+
+    reinhardScalar(r + i, g + i, b + i, output + i, count - i, avgLum, exposureKey);
+}
+
+__attribute__((target("avx2")))
+static inline __m128i narrow8(__m256i v){
+    return _mm_packus_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+}
+
+__attribute__((target("avx2")))
+void reinhardAVX2(const float* r, const float* g, const float* b, RGB* output, size_t count, float avgLum, float exposureKey){
+    uint8_t* out = reinterpret_cast<uint8_t*>(output);
+
+    const __m256 wr = _mm256_set1_ps(LUMINANCE_WEIGHTS.r);
+    const __m256 wg = _mm256_set1_ps(LUMINANCE_WEIGHTS.g);
+    const __m256 wb = _mm256_set1_ps(LUMINANCE_WEIGHTS.b);
+    const __m256 scale = _mm256_set1_ps(exposureKey / avgLum);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 two = _mm256_set1_ps(2.0f);
+    const int32_t* encode = outputEncodeLUT();
+    const __m256 maxOutput = _mm256_set1_ps(encode ? SRGB_ENCODE_SIZE - 1 : 255.0f);
+    const __m256 minL = _mm256_set1_ps(1e-5f);
+
+    size_t i = 0;
+    for(; i + 8 <= count; i += 8){
+        __m256 rv = _mm256_loadu_ps(r + i);
+        __m256 gv = _mm256_loadu_ps(g + i);
+        __m256 bv = _mm256_loadu_ps(b + i);
+
+        __m256 L = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(wr, rv), _mm256_mul_ps(wg, gv)), _mm256_mul_ps(wb, bv));
+
+        __m256 denom = _mm256_add_ps(one, _mm256_mul_ps(scale, L));
+        __m256 rcp = _mm256_rcp_ps(denom);
+        rcp = _mm256_mul_ps(rcp, _mm256_sub_ps(two, _mm256_mul_ps(denom, rcp)));   // one Newton-Raphson step
+
+        __m256 factor = _mm256_mul_ps(_mm256_mul_ps(scale, rcp), maxOutput);
+        factor = _mm256_and_ps(factor, _mm256_cmp_ps(L, minL, _CMP_GE_OQ));
+
+        __m256i r32 = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_mul_ps(rv, factor), maxOutput));
+        __m256i g32 = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_mul_ps(gv, factor), maxOutput));
+        __m256i b32 = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_mul_ps(bv, factor), maxOutput));
+        if(encode){
+            r32 = _mm256_i32gather_epi32(encode, r32, 4);
+            g32 = _mm256_i32gather_epi32(encode, g32, 4);
+            b32 = _mm256_i32gather_epi32(encode, b32, 4);
+        }
+
+        storeRGB8(out + i * 3, narrow8(r32), narrow8(g32), narrow8(b32));
+    }
+
+    reinhardScalar(r + i, g + i, b + i, output + i, count - i, avgLum, exposureKey);
+}
+
+void reinhardExactScalar(const float* r, const float* g, const float* b, RGB* output, size_t count, float avgLum, float exposureKey){
+    const int32_t* encode = outputEncodeLUT();
+    float maxOutput = encode ? SRGB_ENCODE_SIZE - 1 : 255.0f;
+    float scale = exposureKey / avgLum;
+    float scaleMax = scale * maxOutput;
+    for(size_t i = 0; i < count; i++){
+        output[i] = toneMapExact({r[i], g[i], b[i]}, scale, scaleMax, maxOutput, encode);
+    }
+}
+
+__attribute__((target("sse4.1")))
+void reinhardExactSSE41(const float* r, const float* g, const float* b, RGB* output, size_t count, float avgLum, float exposureKey){
+    uint8_t* out = reinterpret_cast<uint8_t*>(output);
+
+    const __m128 wr = _mm_set1_ps(LUMINANCE_WEIGHTS.r);
+    const __m128 wg = _mm_set1_ps(LUMINANCE_WEIGHTS.g);
+    const __m128 wb = _mm_set1_ps(LUMINANCE_WEIGHTS.b);
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 minL = _mm_set1_ps(1e-5f);
+    const int32_t* encode = outputEncodeLUT();
+    float maxValue = encode ? SRGB_ENCODE_SIZE - 1 : 255.0f;
+    float scaleValue = exposureKey / avgLum;
+    const __m128 maxOutput = _mm_set1_ps(maxValue);
+    const __m128 scale = _mm_set1_ps(scaleValue);
+    const __m128 scaleMax = _mm_set1_ps(scaleValue * maxValue);
+
+    size_t i = 0;
+    for(; i + 8 <= count; i += 8){
+        __m128i r32[2], g32[2], b32[2];
+
+        for(int half = 0; half < 2; half++){
+            size_t j = i + half * 4;
+            __m128 rv = _mm_loadu_ps(r + j);
+            __m128 gv = _mm_loadu_ps(g + j);
+            __m128 bv = _mm_loadu_ps(b + j);
+
+            __m128 L = _mm_add_ps(_mm_add_ps(_mm_mul_ps(wr, rv), _mm_mul_ps(wg, gv)), _mm_mul_ps(wb, bv));
+            __m128 factor = _mm_div_ps(scaleMax, _mm_add_ps(one, _mm_mul_ps(scale, L)));
+            factor = _mm_and_ps(factor, _mm_cmpge_ps(L, minL));
+
+            r32[half] = mapChannel4(rv, factor, maxOutput);
+            g32[half] = mapChannel4(gv, factor, maxOutput);
+            b32[half] = mapChannel4(bv, factor, maxOutput);
+        }
+
+        __m128i r16 = _mm_packus_epi32(r32[0], r32[1]);
+        __m128i g16 = _mm_packus_epi32(g32[0], g32[1]);
+        __m128i b16 = _mm_packus_epi32(b32[0], b32[1]);
+        if(encode)
+            encodeRGB8(out + i * 3, r16, g16, b16, encode);
+        else
+            storeRGB8(out + i * 3, r16, g16, b16);
+    }
+
+    reinhardExactScalar(r + i, g + i, b + i, output + i, count - i, avgLum, exposureKey);
+}
+
+__attribute__((target("avx2")))
+void reinhardExactAVX2(const float* r, const float* g, const float* b, RGB* output, size_t count, float avgLum, float exposureKey){
+    uint8_t* out = reinterpret_cast<uint8_t*>(output);
+
+    const __m256 wr = _mm256_set1_ps(LUMINANCE_WEIGHTS.r);
+    const __m256 wg = _mm256_set1_ps(LUMINANCE_WEIGHTS.g);
+    const __m256 wb = _mm256_set1_ps(LUMINANCE_WEIGHTS.b);
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 minL = _mm256_set1_ps(1e-5f);
+    const int32_t* encode = outputEncodeLUT();
+    float maxValue = encode ? SRGB_ENCODE_SIZE - 1 : 255.0f;
+    float scaleValue = exposureKey / avgLum;
+    const __m256 maxOutput = _mm256_set1_ps(maxValue);
+    const __m256 scale = _mm256_set1_ps(scaleValue);
+    const __m256 scaleMax = _mm256_set1_ps(scaleValue * maxValue);
+
+    size_t i = 0;
+    for(; i + 8 <= count; i += 8){
+        __m256 rv = _mm256_loadu_ps(r + i);
+        __m256 gv = _mm256_loadu_ps(g + i);
+        __m256 bv = _mm256_loadu_ps(b + i);
+
+        __m256 L = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(wr, rv), _mm256_mul_ps(wg, gv)), _mm256_mul_ps(wb, bv));
+        __m256 factor = _mm256_div_ps(scaleMax, _mm256_add_ps(one, _mm256_mul_ps(scale, L)));
+        factor = _mm256_and_ps(factor, _mm256_cmp_ps(L, minL, _CMP_GE_OQ));
+
+        __m256i r32 = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_mul_ps(rv, factor), maxOutput));
+        __m256i g32 = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_mul_ps(gv, factor), maxOutput));
+        __m256i b32 = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_mul_ps(bv, factor), maxOutput));
+        if(encode){
+            r32 = _mm256_i32gather_epi32(encode, r32, 4);
+            g32 = _mm256_i32gather_epi32(encode, g32, 4);
+            b32 = _mm256_i32gather_epi32(encode, b32, 4);
+        }
+
+        storeRGB8(out + i * 3, narrow8(r32), narrow8(g32), narrow8(b32));
+    }
+
+    reinhardExactScalar(r + i, g + i, b + i, output + i, count - i, avgLum, exposureKey);
+}
+
+bool kernelISASupported(KernelISA isa){
+    switch(isa){
+        case ISA_AVX2:
+            return __builtin_cpu_supports("avx2");
+        case ISA_SSE41:
+            return __builtin_cpu_supports("sse4.1");
+        default:
+            return true;
+    }
+}
+
+KernelISA detectKernelISA(){
+    if(kernelISASupported(ISA_AVX2))
+        return ISA_AVX2;
+    if(kernelISASupported(ISA_SSE41))
+        return ISA_SSE41;
+    return ISA_SCALAR;
+}
+
+const char* kernelISAName(KernelISA isa){
+    switch(isa){
+        case ISA_AVX2:
+            return "avx2";
+        case ISA_SSE41:
+            return "sse4.1";
+        case ISA_SCALAR:
+            return "scalar";
+        default:
+            return "auto";
+    }
+}
+
+// Falls back to the best supported kernel if the requested one is not available on this CPU. In
+// deterministic mode the exact kernels are returned.
+ReinhardKernel reinhardKernelFor(KernelISA isa){
+    if(isa == ISA_AUTO || !kernelISASupported(isa))
+        isa = detectKernelISA();
+
+    bool exact = deterministicMode();
+    switch(isa){
+        case ISA_AVX2:
+            return exact ? reinhardExactAVX2 : reinhardAVX2;
+        case ISA_SSE41:
+            return exact ? reinhardExactSSE41 : reinhardSSE41;
+        default:
+            return exact ? reinhardExactScalar : reinhardScalar;
+    }
+}
+
+void selectReinhardKernel(KernelISA isa){
+    selectedKernel = reinhardKernelFor(isa);
+}
+
+// Without a selection the automatic kernel is picked once, in a thread-safe static, so contexts of
+// libtonemap created on different threads do not race on selectedKernel.
+ReinhardKernel selectedReinhardKernel(){
+    if(selectedKernel == nullptr){
+        static const ReinhardKernel automatic = reinhardKernelFor(ISA_AUTO);
+        return automatic;
+    }
+    return selectedKernel;
+}
@@ -0,0 +1,69 @@
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include "tone.h"
+
+// sRGB transfer function for the 8-bit input and output (--srgb). Both directions are tables:
+//
+//   decode  256 floats, byte -> linear value; normalizationLUT() hands it out instead of b / 255,
+//           so every decoder linearizes for free.
+//   encode  SRGB_ENCODE_SIZE bytes (stored as int32 for AVX2 gathers), indexed by the linear value
+//           quantized to 12 bits. The mapping kernels quantize to 4095 instead of 255 and look the
+//           byte up; entry k is the encoding of the middle of [k / 4095, (k + 1) / 4095). Near black
+//           one step is 12.92 * 255 / 4095 = 0.8 output codes, so the table stays within 1 LSB of
+//           the exact curve everywhere.
+//
+// Like the Reinhard kernel, the transfer function is chosen once per process, before mapping.
+
+static TransferFunction selectedTransfer = TRANSFER_LINEAR;
+
+void selectTransferFunction(TransferFunction transfer){
+    selectedTransfer = transfer;
+}
+
+TransferFunction selectedTransferFunction(){
+    return selectedTransfer;
+}
+
+double srgbToLinear(double value){
+    return value <= 0.04045 ? value / 12.92 : std::pow((value + 0.055) / 1.055, 2.4);
+}
+
+double linearToSRGB(double value){
+    return value <= 0.0031308 ? value * 12.92 : 1.055 * std::pow(value, 1.0 / 2.4) - 0.055;
+}
+
+const float* srgbDecodeLUT(){
+    static const std::vector<float> table = []{
+        std::vector<float> values(256);
+        for(int i = 0; i < 256; i++){
+            values[i] = (float)srgbToLinear(i / 255.0);
+        }
+        return values;
+    }();
+    return table.data();
+}
+
+static const int32_t* srgbEncodeLUT(){
+    static const std::vector<int32_t> table = []{
+        std::vector<int32_t> values(SRGB_ENCODE_SIZE);
+        for(int k = 0; k < SRGB_ENCODE_SIZE; k++){
+            double linear = std::min(1.0, (k + 0.5) / (SRGB_ENCODE_SIZE - 1));
+            values[k] = (int32_t)std::lround(255.0 * linearToSRGB(linear));
+        }
+        return values;
+    }();
+    return table.data();
+}
+
+const int32_t* outputEncodeLUT(){
+    return selectedTransfer == TRANSFER_SRGB ? srgbEncodeLUT() : nullptr;
+}
+
+RGB toSRGBOutputPixel(RGBf mappedPixel, const int32_t* encode){
+    RGB outPixel;
+    outPixel.r = encodeSRGB(mappedPixel.r, encode);
+    outPixel.g = encodeSRGB(mappedPixel.g, encode);
+    outPixel.b = encodeSRGB(mappedPixel.b, encode);
+    return outPixel;
+}
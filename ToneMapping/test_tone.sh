@@ -0,0 +1,241 @@
+#!/bin/bash
+
+# Regression tests for the tone mapper. Exits non-zero if any test fails.
+
+cd "$(dirname "$0")"
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+TONE="$WORK/tone"
+
+echo "Compiling program..."
+g++ -O2 -pthread tone.cpp toneCore.cpp reinhardKernels.cpp toneLUT.cpp threadPool.cpp toneBatch.cpp toneStrips.cpp bmpFormat.cpp toneHDR.cpp toneOperators.cpp toneSweep.cpp toneCache.cpp toneBench.cpp toneStats.cpp toneExposure.cpp toneSequence.cpp srgbTransfer.cpp toneDeterministic.cpp tonemap.cpp toneMain.cpp -o "$TONE" || exit 1
+
+failures=0
+
+# check "description" command...: the command must succeed
+check() {
+    local description=$1
+    shift
+    if "$@"; then
+        echo "PASS: $description"
+    else
+        echo "FAIL: $description"
+        failures=$((failures + 1))
+    fi
+}
+
+# Little-endian 32-bit value as printf escapes.
+le32() {
+    printf '\\x%02x\\x%02x\\x%02x\\x%02x' $(($1 & 255)) $(($1 >> 8 & 255)) $(($1 >> 16 & 255)) $(($1 >> 24 & 255))
+}
+
+# writeGrayRamp path: 256x4 24-bit BMP whose column x has the value x in every channel.
+writeGrayRamp() {
+    local pixels=$((256 * 4 * 3))
+    {
+        printf "BM$(le32 $((54 + pixels)))\\x00\\x00\\x00\\x00$(le32 54)"
+        printf "$(le32 40)$(le32 256)$(le32 4)\\x01\\x00\\x18\\x00$(le32 0)$(le32 $pixels)$(le32 2835)$(le32 2835)$(le32 0)$(le32 0)"
+        for row in 0 1 2 3; do
+            for x in $(seq 0 255); do
+                printf "\\x$(printf %02x $x)\\x$(printf %02x $x)\\x$(printf %02x $x)"
+            done
+        done
+    } > "$1"
+}
+
+# pixelBytes path x: the B G R bytes of column x in the bottom row of a 24-bit BMP with 54 bytes of headers.
+pixelBytes() {
+    od -An -tu1 -j $((54 + $2 * 3)) -N 3 "$1" | xargs
+}
+
+writeGrayRamp "$WORK/ramp.bmp"
+
+# The extended curve maps a scaled luminance of Lwhite (by default the brightest pixel) to white.
+extendedWhite() {
+    for key in 0.05 0.18 0.3 0.72 1 2.5; do
+        "$TONE" "$WORK/ramp.bmp" "$WORK/extended.bmp" $key 2 --operator extended "$@" > /dev/null || return 1
+        [ "$(pixelBytes "$WORK/extended.bmp" 255)" = "255 255 255" ] || return 1
+    done
+}
+check "extended operator maps Lwhite to white" extendedWhite
+check "extended operator maps Lwhite to white (--srgb)" extendedWhite --srgb
+check "extended operator saturates above --white" extendedWhite --white 0.1
+
+# expectError "message" command...: the command must exit with status 1 and print message.
+expectError() {
+    local message=$1
+    shift
+    local output
+    output=$("$@" 2>&1)
+    [ $? -eq 1 ] && [[ "$output" == *"$message"* ]]
+}
+
+# Radiance HDR files cut off after the resolution line (with and without its newline) and in the
+# middle of the run-length coded scanlines.
+printf '#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y 4 +X 16' > "$WORK/noNewline.hdr"
+printf '#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y 4 +X 16\n' > "$WORK/noPixels.hdr"
+{
+    printf '#?RADIANCE\nFORMAT=32-bit_rle_rgbe\n\n-Y 4 +X 16\n'
+    # One complete scanline: every channel is a single run of 16.
+    printf '\x02\x02\x00\x10\x90\x80\x90\x80\x90\x80\x90\x81'
+} > "$WORK/oneScanline.hdr"
+for file in noNewline noPixels oneScanline; do
+    check "truncated HDR ($file) is rejected" \
+          expectError "Unexpected end of pixel data" "$TONE" "$WORK/$file.hdr" "$WORK/$file.bmp" 0.18 2
+done
+
+# --sequence --adapt 0 writes every frame exactly like a single-image run, headers included.
+sequenceMatchesSingle() {
+    mkdir -p "$WORK/frames"
+    cp jar.bmp lion.bmp "$WORK/frames/"
+    "$TONE" --sequence "$WORK/frames" "$WORK/sequence" 0.18 2 --adapt 0 > /dev/null || return 1
+    for frame in jar lion; do
+        "$TONE" $frame.bmp "$WORK/single.bmp" 0.18 2 > /dev/null || return 1
+        cmp -s "$WORK/sequence/$frame.bmp" "$WORK/single.bmp" || return 1
+    done
+}
+check "--sequence --adapt 0 matches single-image output" sequenceMatchesSingle
+
+# An "auto" run with --stats-cache hits the sidecar the second time and maps with the same key.
+autoKeyCached() {
+    cp lion.bmp "$WORK/cached.bmp"
+    "$TONE" "$WORK/cached.bmp" "$WORK/uncached.bmp" auto 2 > /dev/null || return 1
+    "$TONE" "$WORK/cached.bmp" "$WORK/miss.bmp" auto 2 --stats-cache | grep -q "0 hits, 1 misses" || return 1
+    "$TONE" "$WORK/cached.bmp" "$WORK/hit.bmp" auto 2 --stats-cache | grep -q "1 hits, 0 misses" || return 1
+    cmp -s "$WORK/uncached.bmp" "$WORK/miss.bmp" && cmp -s "$WORK/uncached.bmp" "$WORK/hit.bmp"
+}
+check "auto key is served from --stats-cache" autoKeyCached
+
+# A --batch manifest listing the same basename from two directories is rejected before any mapping.
+duplicateBatchTargets() {
+    mkdir -p "$WORK/a" "$WORK/b"
+    cp lion.bmp "$WORK/a/x.bmp"
+    cp jar.bmp "$WORK/b/x.bmp"
+    printf '%s\n' "$WORK/a/x.bmp" "$WORK/b/x.bmp" > "$WORK/manifest.txt"
+    expectError "would both be written to" "$TONE" --batch "$WORK/manifest.txt" "$WORK/batch" 0.18 2 &&
+        [ ! -e "$WORK/batch/x.bmp" ]
+}
+check "--batch rejects duplicate targets" duplicateBatchTargets
+
+# --sweep replaces [exposure_key], so it may be left out; with or without it the outputs are the same.
+sweepWithoutKey() {
+    "$TONE" lion.bmp "$WORK/keyed.bmp" 0.18 2 --sweep 0.1,0.5 > /dev/null || return 1
+    "$TONE" lion.bmp "$WORK/keyless.bmp" 2 --sweep 0.1,0.5 > /dev/null || return 1
+    cmp -s "$WORK/keyed_0.1.bmp" "$WORK/keyless_0.1.bmp" && cmp -s "$WORK/keyed_0.5.bmp" "$WORK/keyless_0.5.bmp"
+}
+check "--sweep without [exposure_key]" sweepWithoutKey
+check "--sweep rejects duplicate keys" \
+      expectError "0.1 is listed more than once in --sweep." "$TONE" lion.bmp "$WORK/duplicate.bmp" 2 --sweep 0.1,0.5,0.1
+
+# libtonemap builds from its own sources alone, never references exit(), and maps RGB32F rows whose
+# stride is not a multiple of 4 (checked by the alignment sanitizer).
+libraryAlone() {
+    mkdir -p "$WORK/lib"
+    for source in tonemap.cpp toneCore.cpp threadPool.cpp reinhardKernels.cpp toneLUT.cpp toneOperators.cpp \
+                  toneExposure.cpp toneCache.cpp srgbTransfer.cpp toneDeterministic.cpp; do
+        g++ -O2 -pthread -fsanitize=alignment -fno-sanitize-recover=all -c "$source" \
+            -o "$WORK/lib/${source%.cpp}.o" || return 1
+    done
+    nm -u "$WORK"/lib/*.o | grep -qw exit && return 1
+    cat > "$WORK/lib/main.cpp" <<'END'
+#include <cstring>
+#include "tonemap.h"
+int main(){
+    unsigned char input[1 + 2 * 31];
+    for(int y = 0; y < 2; y++){
+        for(int i = 0; i < 6; i++){
+            float value = 0.1f * (y * 6 + i + 1);
+            memcpy(input + 1 + y * 31 + i * sizeof(float), &value, sizeof(float));
+        }
+    }
+    TonemapImage image = {input + 1, 2, 2, 31, TONEMAP_FORMAT_RGB32F};
+    TonemapParams params;
+    tonemapDefaultParams(&params);
+    TonemapContext* context;
+    uint8_t output[2 * 6];
+    if(tonemapCreate(2, &context) != TONEMAP_OK)
+        return 1;
+    TonemapStatus status = tonemapMap(context, &image, &params, output, 6, nullptr);
+    tonemapDestroy(context);
+    return status == TONEMAP_OK ? 0 : 1;
+}
+END
+    g++ -O2 -pthread -fsanitize=alignment -fno-sanitize-recover=all -I. "$WORK/lib/main.cpp" "$WORK"/lib/*.o \
+        -o "$WORK/lib/main" && "$WORK/lib/main"
+}
+check "libtonemap builds alone and maps unaligned rows" libraryAlone
+
+# The local operator's blur picks its SIMD width from the CPU, not from --kernel, and every width
+# gives the same bits.
+localBlurKernels() {
+    "$TONE" lion.bmp "$WORK/local_auto.bmp" 0.18 2 --operator local > /dev/null || return 1
+    for kernel in scalar sse4.1 avx2; do
+        "$TONE" lion.bmp "$WORK/local_$kernel.bmp" 0.18 2 --operator local --kernel $kernel > /dev/null || return 1
+        cmp -s "$WORK/local_auto.bmp" "$WORK/local_$kernel.bmp" || return 1
+    done
+}
+check "local operator output does not depend on --kernel" localBlurKernels
+
+# --deterministic output is bit-identical whatever the thread count, tile size, Reinhard kernel and
+# file path (fstream, --mmap, --pread, --stream), with and without "auto". The input is a 1021x769
+# noise image (padded rows), on which several of these runs differ without --deterministic.
+deterministicInvariance() {
+    local stride=$(((1021 * 3 + 3) / 4 * 4))
+    {
+        printf "BM$(le32 $((54 + stride * 769)))\\x00\\x00\\x00\\x00$(le32 54)"
+        printf "$(le32 40)$(le32 1021)$(le32 769)\\x01\\x00\\x18\\x00$(le32 0)$(le32 $((stride * 769)))$(le32 2835)$(le32 2835)$(le32 0)$(le32 0)"
+        head -c $((stride * 769)) /dev/urandom
+    } > "$WORK/noise.bmp"
+
+    local key
+    for key in 0.18 auto; do
+        "$TONE" "$WORK/noise.bmp" "$WORK/det_reference.bmp" $key 1 --deterministic > /dev/null || return 1
+        local variant=0
+        while read -r threads options; do
+            variant=$((variant + 1))
+            "$TONE" "$WORK/noise.bmp" "$WORK/det_$variant.bmp" $key $threads --deterministic $options > /dev/null ||
+                return 1
+            cmp -s "$WORK/det_reference.bmp" "$WORK/det_$variant.bmp" || { echo "  differs: $key $threads $options"; return 1; }
+        done <<'END'
+3
+4 --tile-rows 7
+2 --tile-rows 1 --kernel scalar
+4 --kernel sse4.1
+3 --kernel avx2 --tile-rows 200
+2 --mmap
+4 --mmap --kernel scalar
+3 --pread --tile-rows 13
+2 --stream 1
+4 --stream 1 --kernel sse4.1 --tile-rows 5
+END
+    done
+}
+check "--deterministic output does not depend on threads, tiles, kernel or file path" deterministicInvariance
+
+# A worker that runs out of memory (the local operator's blur buffers under a 400 MB address space
+# limit) is reported as an error instead of terminating the process.
+pixels=$((4000 * 4000 * 3))
+mkdir -p "$WORK/large"
+{
+    printf "BM$(le32 $((54 + pixels)))\\x00\\x00\\x00\\x00$(le32 54)"
+    printf "$(le32 40)$(le32 4000)$(le32 4000)\\x01\\x00\\x18\\x00$(le32 0)$(le32 $pixels)$(le32 2835)$(le32 2835)$(le32 0)$(le32 0)"
+    head -c $pixels /dev/urandom
+} > "$WORK/large/large.bmp"
+
+workerOutOfMemory() {
+    (ulimit -v 400000; expectError "Error:" "$TONE" "$WORK/large/large.bmp" "$WORK/large_out.bmp" 0.18 2 --operator local)
+}
+check "out of memory on a worker thread is an error" workerOutOfMemory
+
+# The same in --sequence mode, where the reader and writer threads must be joined before the error.
+sequenceOutOfMemory() {
+    (ulimit -v 400000; expectError "Error:" "$TONE" --sequence "$WORK/large" "$WORK/large_sequence" 0.18 2 --operator local)
+}
+check "out of memory in --sequence is an error" sequenceOutOfMemory
+
+echo
+if [ $failures -ne 0 ]; then
+    echo "$failures test(s) failed."
+    exit 1
+fi
+echo "All tests passed!"
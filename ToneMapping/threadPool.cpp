@@ -0,0 +1,223 @@
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+#include <pthread.h>
+#include <sched.h>
+#include "threadPool.h"
+
+static void clearTimings(TileTimings& timings){
+    memset(&timings, 0, sizeof(timings));
+}
+
+ThreadPool::ThreadPool(int numThreads, int tileRows)
+    : rowsPerTile(std::max(1, tileRows)), task(nullptr), generation(0), activeWorkers(0), stopping(false),
+      failed(false) {
+
+    for(int i = 0; i < std::max(1, numThreads); i++){
+        queues.push_back(std::unique_ptr<WorkerQueue>(new WorkerQueue()));
+        queues[i]->next = 0;
+        queues[i]->end = 0;
+        clearTimings(queues[i]->timings);
+    }
+    for(int i = 0; i < numThreads; i++){
+        threads.push_back(std::thread(&ThreadPool::workerLoop, this, i));
+    }
+}
+
+ThreadPool::~ThreadPool(){
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+
+    for(auto& thread : threads){
+        thread.join();
+    }
+}
+
+void ThreadPool::parallelFor(int numTiles, const std::function<void(int tile, int worker)>& job){
+    if(numTiles <= 0)
+        return;
+
+    error = nullptr;
+    failed = false;
+
+    if(threads.empty()){
+        task = &job;
+        for(int tile = 0; tile < numTiles; tile++){
+            runTile(0, tile, false);
+        }
+        task = nullptr;
+        rethrowError();
+        return;
+    }
+
+    int numWorkers = size();
+
+    std::unique_lock<std::mutex> lock(mutex);
+
+    for(int i = 0; i < numWorkers; i++){
+        std::lock_guard<std::mutex> queueLock(queues[i]->mutex);
+        queues[i]->next = (int)((int64_t)numTiles * i / numWorkers);
+        queues[i]->end = (int)((int64_t)numTiles * (i + 1) / numWorkers);
+    }
+
+    task = &job;
+    activeWorkers = numWorkers;
+    generation++;
+    wake.notify_all();
+
+    done.wait(lock, [&]{ return activeWorkers == 0; });
+    task = nullptr;
+    lock.unlock();
+    rethrowError();
+}
+
+void ThreadPool::rethrowError(){
+    if(error){
+        std::exception_ptr thrown = error;
+        error = nullptr;
+        std::rethrow_exception(thrown);
+    }
+}
+
+bool ThreadPool::popTile(int worker, int& tile){
+    WorkerQueue& queue = *queues[worker];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+
+    if(queue.next >= queue.end)
+        return false;
+    tile = queue.next++;
+    return true;
+}
+
+// Takes the last tile of the first other worker that still has work, so the victim keeps
+// the front of its block (the rows it is about to touch).
+bool ThreadPool::stealTile(int worker, int& tile){
+    int numWorkers = size();
+
+    for(int i = 1; i < numWorkers; i++){
+        WorkerQueue& victim = *queues[(worker + i) % numWorkers];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+
+        if(victim.next < victim.end){
+            tile = --victim.end;
+            return true;
+        }
+    }
+    return false;
+}
+
+// An exception escaping a task would terminate a worker thread, so it is kept for parallelFor()
+// to rethrow and the rest of the job is skipped.
+void ThreadPool::runTile(int worker, int tile, bool stolen){
+    if(failed.load(std::memory_order_relaxed))
+        return;
+
+    auto start = std::chrono::steady_clock::now();
+    try {
+        (*task)(tile, worker);
+    }
+    catch(...){
+        std::lock_guard<std::mutex> lock(mutex);
+        if(!error)
+            error = std::current_exception();
+        failed = true;
+        return;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    // Only this worker writes its timings, so no lock is needed while a job runs.
+    TileTimings& timings = queues[worker]->timings;
+    uint64_t micros = (uint64_t)(elapsed.count() * 1e6);
+    int bucket = 0;
+    while(micros > 1 && bucket < TILE_TIMING_BUCKETS - 1){
+        micros >>= 1;
+        bucket++;
+    }
+    timings.buckets[bucket]++;
+    timings.tiles++;
+    timings.steals += stolen;
+    timings.totalSeconds += elapsed.count();
+    timings.maxSeconds = std::max(timings.maxSeconds, elapsed.count());
+}
+
+void ThreadPool::workerLoop(int worker){
+    uint64_t seenGeneration = 0;
+
+    while(true){
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&]{ return stopping || generation != seenGeneration; });
+            if(stopping)
+                return;
+            seenGeneration = generation;
+        }
+
+        int tile;
+        while(popTile(worker, tile)){
+            runTile(worker, tile, false);
+        }
+        while(stealTile(worker, tile)){
+            runTile(worker, tile, true);
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if(--activeWorkers == 0)
+            done.notify_one();
+    }
+}
+
+TileTimings ThreadPool::tileTimings() const {
+    TileTimings total;
+    clearTimings(total);
+
+    for(const auto& queue : queues){
+        for(int i = 0; i < TILE_TIMING_BUCKETS; i++){
+            total.buckets[i] += queue->timings.buckets[i];
+        }
+        total.tiles += queue->timings.tiles;
+        total.steals += queue->timings.steals;
+        total.totalSeconds += queue->timings.totalSeconds;
+        total.maxSeconds = std::max(total.maxSeconds, queue->timings.maxSeconds);
+    }
+    return total;
+}
+
+bool ThreadPool::pinWorkers(){
+    cpu_set_t allowed;
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return false;
+
+    std::vector<int> cpus;
+    for(int cpu = 0; cpu < CPU_SETSIZE; cpu++){
+        if(CPU_ISSET(cpu, &allowed))
+            cpus.push_back(cpu);
+    }
+    if(cpus.empty())
+        return false;
+
+    bool pinned = true;
+    for(size_t i = 0; i < threads.size(); i++){
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpus[i % cpus.size()], &set);
+        pinned = pthread_setaffinity_np(threads[i].native_handle(), sizeof(set), &set) == 0 && pinned;
+    }
+    return pinned;
+}
+
+std::vector<double> ThreadPool::workerSeconds() const {
+    std::vector<double> seconds;
+    for(const auto& queue : queues){
+        seconds.push_back(queue->timings.totalSeconds);
+    }
+    return seconds;
+}
+
+void ThreadPool::resetTileTimings(){
+    for(auto& queue : queues){
+        clearTimings(queue->timings);
+    }
+}
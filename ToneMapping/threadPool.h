@@ -0,0 +1,98 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <cstdint>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <algorithm>
+
+// Default tile height in rows for parallelFor() over an image.
+const int DEFAULT_TILE_ROWS = 64;
+
+// Bucket i counts tiles that took [2^i, 2^(i+1)) microseconds, bucket 0 also holds anything faster.
+const int TILE_TIMING_BUCKETS = 24;
+
+struct TileTimings {
+    uint64_t buckets[TILE_TIMING_BUCKETS];
+    uint64_t tiles;
+    uint64_t steals;
+    double totalSeconds;
+    double maxSeconds;
+};
+
+// Persistent worker threads shared by every stage and every image of a run. A pool of 0 threads
+// runs every tile on the calling thread as worker 0 (used for per-image work inside another pool).
+// parallelFor() deals the tiles out in one contiguous block per worker (so consecutive stages
+// over the same image give a worker the same rows); a worker that runs out of tiles steals
+// single tiles from the back of another worker's block, so a descheduled thread does not hold
+// up the whole image.
+class ThreadPool {
+public:
+    explicit ThreadPool(int numThreads, int tileRows = DEFAULT_TILE_ROWS);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Number of worker slots, at least 1.
+    int size() const { return (int)queues.size(); }
+    int tileRows() const { return rowsPerTile; }
+
+    // Number of tiles covering height rows and the rows of one tile.
+    int tileCount(int height) const { return (height + rowsPerTile - 1) / rowsPerTile; }
+    int tileStart(int tile) const { return tile * rowsPerTile; }
+    int tileEnd(int tile, int height) const { return std::min(height, (tile + 1) * rowsPerTile); }
+
+    // Runs task(tile, worker) for every tile in [0, numTiles) and returns when all are done.
+    // If a task throws, the tiles not yet started are skipped and the first exception is rethrown
+    // here on the calling thread. Must not be called from inside a task.
+    void parallelFor(int numTiles, const std::function<void(int tile, int worker)>& task);
+
+    // Per-tile timing histogram summed over all workers since the last reset.
+    TileTimings tileTimings() const;
+    void resetTileTimings();
+
+    // Pins worker i to the i-th CPU the process may run on (wrapping around), so a worker stays
+    // next to the pages it first touched. Returns false if the affinity could not be set.
+    bool pinWorkers();
+
+    // Seconds each worker has spent running tiles since the last reset.
+    std::vector<double> workerSeconds() const;
+
+private:
+    struct alignas(64) WorkerQueue {
+        std::mutex mutex;
+        int next;
+        int end;
+        TileTimings timings;
+    };
+
+    bool popTile(int worker, int& tile);
+    bool stealTile(int worker, int& tile);
+    void runTile(int worker, int tile, bool stolen);
+    void rethrowError();
+    void workerLoop(int worker);
+
+    std::vector<std::thread> threads;
+    std::vector<std::unique_ptr<WorkerQueue>> queues;
+    int rowsPerTile;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const std::function<void(int, int)>* task;
+    uint64_t generation;
+    int activeWorkers;
+    bool stopping;
+
+    // First exception thrown by a task of the current job, guarded by mutex.
+    std::exception_ptr error;
+    std::atomic<bool> failed;
+};
+
+#endif
@@ -5,287 +5,1219 @@
 #include <cmath>
 #include <thread>
 #include <algorithm>
+#include <chrono>
+#include <atomic>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "tone.h"
+#include "threadPool.h"
 
 
+void toneMap(const ToneOptions& options, ThreadPool& pool){
 
-int main(int argc, char* argv[]){
+    if(options.batch){
+        toneMapBatch(options, pool);
+        return;
+    }
+
+    if(options.sequence){
+        toneMapSequence(options, pool);
+        return;
+    }
+
+    if(!options.sweepKeys.empty()){
+        toneMapSweep(options, pool);
+        return;
+    }
+
+    float logAvgLuminance = toneMapFile(options, pool);
+
+    std::cout << logAvgLuminance << std::endl;
+
+    std::cout << "Tone mapping completed successfully." << std::endl;
+}
+
+// Maps options.srcPath to options.targetPath and returns the log-average luminance.
+// Prints nothing, so batch mode can run several of these at once.
+float toneMapFile(const ToneOptions& options, ThreadPool& pool){
+
+    if(options.statsCache && options.luminanceCache == nullptr){
+        LuminanceCacheEntry luminanceCache;
+        loadLuminanceCache(options.srcPath, luminanceCache);
+
+        ToneOptions cachedOptions = options;
+        cachedOptions.luminanceCache = &luminanceCache;
+        float logAvgLuminance = toneMapFile(cachedOptions, pool);
+
+        storeLuminanceCache(options.srcPath, luminanceCache);
+        return logAvgLuminance;
+    }
 
-    argCheck(argc, argv);
+    // PFM / Radiance HDR input always takes the float path (see toneHDR.cpp).
+    if(isHDRPath(options.srcPath))
+        return toneMapHDR(options, pool);
 
-    toneMap(argc, argv);
+    if(options.streamBytes != 0)
+        return toneMapStrips(options, pool);
 
+    if(options.useMmap)
+        return toneMapMmap(options, pool);
+
+    return toneMapStream(options, pool);
 }
 
-void toneMap(int argc, char *argv[]){
+float toneMapStream(const ToneOptions& options, ThreadPool& pool){
 
-    std::fstream readBMP(argv[1], std::ios::binary | std::ios::in);
+    std::fstream readBMP(options.srcPath, std::ios::binary | std::ios::in);
 
-    std::fstream writeBMP(argv[2], std::ios::binary | std::ios::out);
+    std::fstream writeBMP(options.targetPath, std::ios::binary | std::ios::out);
 
     if(!readBMP){
-        std::cerr << "Error: Cannot open file " << argv[1] << std::endl;
+        std::cerr << "Error: Cannot open file " << options.srcPath << std::endl;
         exit(1);
     }
     if(!writeBMP){
-        std::cerr << "Error: Cannot open file " <<  argv[2] << std::endl;
+        std::cerr << "Error: Cannot open file " <<  options.targetPath << std::endl;
         exit(1);
     }
 
-    char signature[3];
-    signature[2] = '\0';
+    BMPFileHeader bmpFile;
+    BMPInfoHeader bmpInfo;
+
+    StageTimer stage(&pool);
+    stage.begin("header parse");
+    readBMPHeaders(readBMP, bmpFile, bmpInfo);
+    BMPFormat format = readBMPFormat(readBMP, bmpInfo);
+    stage.count(bmpFile.dataOffset, 0, 0);
+
+    size_t totalPixels = (size_t)format.width * format.height;
+    size_t pixelBytes = format.srcStride * format.height;
+
+    if(options.useLUT){
+        stage.begin("read");
+        std::vector<uint8_t> rawPixels;
+        readBMPPixelArray(readBMP, bmpFile, format, rawPixels);
+        stage.count(pixelBytes, 0, totalPixels);
+
+        size_t rowStride = bmpRowStride(format.width);
+        BMPPixelArray outputRows(rowStride * format.height, 0);
+
+        stage.begin("lut map");
+        float logAvgLuminance = toneMapLUT(rawPixels.data(), rowStride, outputRows.data(), rowStride,
+                                           format.width, format.height, options.exposureKey, pool,
+                                           options.luminanceCache);
+        stage.count(0, 0, totalPixels);
 
+        stage.begin("write");
+        writeBMPPixelArray(writeBMP, bmpFile, bmpInfo, outputRows);
+        writeBMP.close();
+        stage.count(0, BMP_HEADER_SIZE + outputRows.size(), 0);
 
+        return logAvgLuminance;
+    }
+
+
+    float exposureKey = options.exposureKey;
+
+    float logAvgLuminance;
+
+    // Prepare output pixel array
+    RGBBuffer outputPixels;
+
+    // The fused pipeline computes luminance while it decodes, so --stats-cache has nothing to skip there.
+    if(options.fused){
+        stage.begin("read");
+        std::vector<uint8_t> rawPixels;
+        readBMPPixelArray(readBMP, bmpFile, format, rawPixels);
+        stage.count(pixelBytes, 0, totalPixels);
+
+        stage.begin("fused map");
+        logAvgLuminance = toneMapFused(rawPixels.data(), bmpRowStride(format.width), format.width, format.height,
+                                       outputPixels, exposureKey, pool);
+        stage.count(0, 0, totalPixels);
+    }
+    else {
+        stage.begin("decode");
+        PlanarImage normalizedpixels;
+        if(options.usePread)
+            preadBMPPixels(options.srcPath, bmpFile, format, normalizedpixels, pool);
+        else
+            decodeBMPPixels(readBMP, bmpFile, format, normalizedpixels, &pool);
+        stage.count(pixelBytes, 0, totalPixels);
+
+        stage.begin("luminance");
+        ToneOptions mapOptions = options;
+        logAvgLuminance = planarLogAverage(options, normalizedpixels, pool, mapOptions.exposureKey);
+        stage.count(0, 0, totalPixels);
+
+        stage.begin("map");
+        toneMapPlanar(mapOptions, normalizedpixels, logAvgLuminance, outputPixels, pool);
+        stage.count(0, 0, totalPixels);
+    }
+
+    // Rows are assembled in parallel into the padded pixel array, then written with one write().
+    stage.begin("encode");
+    BMPPixelArray outputRows;
+    encodeBMPPixelArray(outputPixels, format.width, format.height, outputRows, pool);
+    stage.count(0, 0, totalPixels);
+
+    stage.begin("write");
+    writeBMPPixelArray(writeBMP, bmpFile, bmpInfo, outputRows);
+
+    readBMP.close();
+    writeBMP.close();
+    stage.count(0, BMP_HEADER_SIZE + outputRows.size(), 0);
+
+    return logAvgLuminance;
+}
+
+
+// ./tone --bench-kernel [megapixels] [iterations]
+// Runs every Reinhard kernel the CPU supports on one thread over random pixels and reports
+// pixels/s plus the largest per-channel difference from the scalar kernel, with linear output and
+// again with the sRGB encode table (--srgb), whose speed is also given relative to linear output.
+void benchKernel(int argc, char *argv[]){
+    if(argc > 4){
+        std::cout << "./tone --bench-kernel [megapixels] [iterations]" << std::endl;
+        exit(1);
+    }
+
+    double megapixels = (argc >= 3) ? std::atof(argv[2]) : 16.0;
+    int iterations = (argc == 4) ? std::atoi(argv[3]) : 5;
+    if(megapixels <= 0.0 || iterations <= 0){
+        std::cout << "[megapixels] and [iterations] must be positive." << std::endl;
+        exit(1);
+    }
+
+    size_t count = (size_t)(megapixels * 1000000.0);
+    PlanarImage input(count, 1);
+    std::vector<RGB> reference(count);
+    std::vector<RGB> output(count);
+
+    // Cheap LCG so every run maps the same pixels
+    uint32_t seed = 12345;
+    for(size_t i = 0; i < count; i++){
+        seed = seed * 1664525u + 1013904223u;
+        input.r[i] = (seed >> 24) / 255.0f;
+        input.g[i] = ((seed >> 16) & 0xff) / 255.0f;
+        input.b[i] = ((seed >> 8) & 0xff) / 255.0f;
+    }
+
+    ThreadPool pool(1);
+    float avgLum = logAverageLuminance(input, pool);
+    float exposureKey = 0.18f;
+
+    KernelISA isas[] = {ISA_SCALAR, ISA_SSE41, ISA_AVX2};
+    double linearRate[3] = {0.0, 0.0, 0.0};
+
+    for(TransferFunction transfer : {TRANSFER_LINEAR, TRANSFER_SRGB}){
+        selectTransferFunction(transfer);
+        reinhardScalar(input.r, input.g, input.b, reference.data(), count, avgLum, exposureKey);
+
+        if(transfer == TRANSFER_SRGB){
+            // The encode table against the exact curve on the scalar kernel's mapped values.
+            int tableError = 0;
+            for(size_t i = 0; i < count; i++){
+                RGBf pixel = {input.r[i], input.g[i], input.b[i]};
+                RGBf mapped = toneMapReinhard(pixel, avgLum, exposureKey);
+                int exact = (int)std::lround(255.0 * linearToSRGB(std::min(1.0f, std::max(0.0f, mapped.g))));
+                tableError = std::max(tableError, std::abs(reference[i].g - exact));
+            }
+            std::cout << "srgb encode table: max error " << tableError << " LSB vs the exact curve" << std::endl;
+        }
+
+        for(int k = 0; k < 3; k++){
+            KernelISA isa = isas[k];
+            const char* suffix = transfer == TRANSFER_SRGB ? " srgb" : "";
+            if(!kernelISASupported(isa)){
+                std::cout << kernelISAName(isa) << suffix << ": not supported" << std::endl;
+                continue;
+            }
+            ReinhardKernel kernel = reinhardKernelFor(isa);
+
+            double best = 0.0;
+            for(int i = 0; i < iterations; i++){
+                auto start = std::chrono::steady_clock::now();
+                kernel(input.r, input.g, input.b, output.data(), count, avgLum, exposureKey);
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                best = std::max(best, count / elapsed.count());
+            }
+
+            int maxError = 0;
+            for(size_t i = 0; i < count; i++){
+                maxError = std::max(maxError, std::abs(output[i].r - reference[i].r));
+                maxError = std::max(maxError, std::abs(output[i].g - reference[i].g));
+                maxError = std::max(maxError, std::abs(output[i].b - reference[i].b));
+            }
+
+            std::cout << kernelISAName(isa) << suffix << ": " << best / 1e6 << " Mpixels/s per core";
+            if(transfer == TRANSFER_SRGB)
+                std::cout << " (" << (int)std::lround(100.0 * best / linearRate[k]) << "% of linear)";
+            else
+                linearRate[k] = best;
+            std::cout << ", max error " << maxError << " LSB" << std::endl;
+        }
+    }
+    selectTransferFunction(TRANSFER_LINEAR);
+}
+
+// ./tone --bench-lut [SRC imagename] [exposure_key] [iterations]
+// Times the float path (decode to planes, luminance, Reinhard kernel) against the LUT path
+// (histogram, table build, integer mapping) on one thread and reports the max error against scalar.
+void benchLUT(int argc, char *argv[]){
+    if(argc < 3 || argc > 5){
+        std::cout << "./tone --bench-lut [SRC imagename] [exposure_key] [iterations]" << std::endl;
+        exit(1);
+    }
+
+    float exposureKey = (argc >= 4) ? std::atof(argv[3]) : 0.18f;
+    int iterations = (argc == 5) ? std::atoi(argv[4]) : 5;
+    if(exposureKey <= 0.0f || iterations <= 0){
+        std::cout << "[exposure_key] and [iterations] must be positive." << std::endl;
+        exit(1);
+    }
+
+    std::ifstream readBMP(argv[2], std::ios::binary);
+    if(!readBMP){
+        std::cerr << "Error: Cannot open file " << argv[2] << std::endl;
+        exit(1);
+    }
     BMPFileHeader bmpFile;
     BMPInfoHeader bmpInfo;
+    readBMPHeaders(readBMP, bmpFile, bmpInfo);
+    BMPFormat format = readBMPFormat(readBMP, bmpInfo);
+    std::vector<uint8_t> rawPixels;
+    readBMPPixelArray(readBMP, bmpFile, format, rawPixels);
+
+    int width = format.width;
+    int height = format.height;
+    size_t rowStride = bmpRowStride(width);
+    size_t totalPixels = (size_t)width * height;
+
+    PlanarImage planes(width, height);
+    std::vector<RGB> floatOutput(totalPixels);
+    std::vector<RGB> reference(totalPixels);
+    std::vector<uint8_t> lutOutput(rowStride * height, 0);
+    ReinhardKernel kernel = selectedReinhardKernel();
+
+    double bestFloat = 0.0;
+    float floatAvgLum = 0.0f;
+    for(int i = 0; i < iterations; i++){
+        auto start = std::chrono::steady_clock::now();
+        double partialSum;
+        decodeRows(0, height, width, rawPixels.data(), rowStride, planes, partialSum);
+        floatAvgLum = (float)std::exp(partialSum / totalPixels);
+        kernel(planes.r, planes.g, planes.b, floatOutput.data(), totalPixels, floatAvgLum, exposureKey);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        bestFloat = std::max(bestFloat, totalPixels / elapsed.count());
+    }
 
+    ThreadPool pool(1);
+    double bestLUT = 0.0;
+    float lutAvgLum = 0.0f;
+    for(int i = 0; i < iterations; i++){
+        auto start = std::chrono::steady_clock::now();
+        lutAvgLum = toneMapLUT(rawPixels.data(), rowStride, lutOutput.data(), rowStride, width, height, exposureKey, pool);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        bestLUT = std::max(bestLUT, totalPixels / elapsed.count());
+    }
 
-    bmpFile.signature[2] = '\0';
+    // Error is measured against the exact scalar float mapping.
+    reinhardScalar(planes.r, planes.g, planes.b, reference.data(), totalPixels, floatAvgLum, exposureKey);
+    int maxError = 0;
+    for(int i = 0; i < height; i++){
+        const uint8_t* out = lutOutput.data() + i * rowStride;
+        for(int j = 0; j < width; j++){
+            const RGB& expected = reference[(size_t)i * width + j];
+            maxError = std::max(maxError, std::abs(out[0] - expected.b));
+            maxError = std::max(maxError, std::abs(out[1] - expected.g));
+            maxError = std::max(maxError, std::abs(out[2] - expected.r));
+            out += 3;
+        }
+    }
 
-    readBMP.read(reinterpret_cast<char*>(&bmpFile.signature), 2);
-    // std::cout << "Signature: " << bmpFile.signature << std::endl;
+    std::cout << "float (" << kernelISAName(detectKernelISA()) << "): " << bestFloat / 1e6 << " Mpixels/s, log average " << floatAvgLum << std::endl;
+    std::cout << "lut: " << bestLUT / 1e6 << " Mpixels/s, log average " << lutAvgLum << std::endl;
+    std::cout << "max error " << maxError << " LSB" << std::endl;
+}
 
-    readBMP.read(reinterpret_cast<char*>(&bmpFile.fileSize), 4);
-    // std::cout << "File Size: " << bmpFile.fileSize << " bytes" << std::endl;
+// Reads the 14-byte file header and the 40-byte info header in one read and parses them.
+void readBMPHeaders(std::istream& readBMP, BMPFileHeader& bmpFile, BMPInfoHeader& bmpInfo){
 
-    readBMP.read(reinterpret_cast<char*>(&bmpFile.reserved1), 2);
-    // std::cout << "Reserved1: " << bmpFile.reserved1 << std::endl;
+    uint8_t headers[BMP_HEADER_SIZE];
 
-    readBMP.read(reinterpret_cast<char*>(&bmpFile.reserved2), 2);
-    // std::cout << "Reserved2: " << bmpFile.reserved2 << std::endl;
+    readBMP.read(reinterpret_cast<char*>(headers), BMP_HEADER_SIZE);
+    if(!readBMP){
+        std::cerr << "Error: File is too small to be a BMP" << std::endl;
+        exit(1);
+    }
 
-    readBMP.read(reinterpret_cast<char*>(&bmpFile.dataOffset), 4);
-    // std::cout << "Pixel Data Offset: " << bmpFile.dataOffset << " bytes" << std::endl;
+    parseBMPHeaders(headers, bmpFile, bmpInfo);
+}
 
-    readBMP.read(reinterpret_cast<char*>(&bmpInfo.headerSize), 4);
-    // std::cout << "Size of Header: " << bmpInfo.headerSize << std::endl;
+// Field by field copy, since BMPFileHeader keeps a NUL terminated signature
+// and does not match the on-disk layout.
+void parseBMPHeaders(const uint8_t* data, BMPFileHeader& bmpFile, BMPInfoHeader& bmpInfo){
 
-    readBMP.read(reinterpret_cast<char*>(&bmpInfo.width), 4);
-    // std::cout << "Image Width: " << bmpInfo.width << std::endl;
+    memcpy(bmpFile.signature, data + 0, 2);
+    bmpFile.signature[2] = '\0';
+    memcpy(&bmpFile.fileSize, data + 2, 4);
+    memcpy(&bmpFile.reserved1, data + 6, 2);
+    memcpy(&bmpFile.reserved2, data + 8, 2);
+    memcpy(&bmpFile.dataOffset, data + 10, 4);
+
+    memcpy(&bmpInfo.headerSize, data + 14, 4);
+    memcpy(&bmpInfo.width, data + 18, 4);
+    memcpy(&bmpInfo.height, data + 22, 4);
+    memcpy(&bmpInfo.planes, data + 26, 2);
+    memcpy(&bmpInfo.bitCount, data + 28, 2);
+    memcpy(&bmpInfo.compression, data + 30, 4);
+    memcpy(&bmpInfo.imageSize, data + 34, 4);
+    memcpy(&bmpInfo.xPixelsPerm, data + 38, 4);
+    memcpy(&bmpInfo.yPixelsPerm, data + 42, 4);
+    memcpy(&bmpInfo.colorsUsed, data + 46, 4);
+    memcpy(&bmpInfo.colorsImportant, data + 50, 4);
+}
 
-    readBMP.read(reinterpret_cast<char*>(&bmpInfo.height), 4);
-    // std::cout << "Image Height: " << bmpInfo.height << std::endl;
+// Inverse of parseBMPHeaders(), writes BMP_HEADER_SIZE bytes to data.
+void serializeBMPHeaders(uint8_t* data, const BMPFileHeader& bmpFile, const BMPInfoHeader& bmpInfo){
+
+    memcpy(data + 0, bmpFile.signature, 2);
+    memcpy(data + 2, &bmpFile.fileSize, 4);
+    memcpy(data + 6, &bmpFile.reserved1, 2);
+    memcpy(data + 8, &bmpFile.reserved2, 2);
+    memcpy(data + 10, &bmpFile.dataOffset, 4);
+
+    memcpy(data + 14, &bmpInfo.headerSize, 4);
+    memcpy(data + 18, &bmpInfo.width, 4);
+    memcpy(data + 22, &bmpInfo.height, 4);
+    memcpy(data + 26, &bmpInfo.planes, 2);
+    memcpy(data + 28, &bmpInfo.bitCount, 2);
+    memcpy(data + 30, &bmpInfo.compression, 4);
+    memcpy(data + 34, &bmpInfo.imageSize, 4);
+    memcpy(data + 38, &bmpInfo.xPixelsPerm, 4);
+    memcpy(data + 42, &bmpInfo.yPixelsPerm, 4);
+    memcpy(data + 46, &bmpInfo.colorsUsed, 4);
+    memcpy(data + 50, &bmpInfo.colorsImportant, 4);
+}
 
-    // After reading Image Height
-    readBMP.read(reinterpret_cast<char*>(&bmpInfo.planes), 2);  // Read Planes (should be 1)
-    // std::cout << "Planes: " << bmpInfo.planes << std::endl;
+// Decodes the pixel array into normalized float planes. Whole padded rows are pulled in with one
+// read() per strip of up to DECODE_STRIP_BYTES and split into R, G, B planes in a single pass
+// (see decodeBMPRows() for the per-format loops).
+// The planes are first touched by the pool workers if a pool is given; the decode itself is serial.
+void decodeBMPPixels(std::istream& readBMP, const BMPFileHeader& bmpFile, const BMPFormat& format, PlanarImage& output,
+                     ThreadPool* pool){
 
-    readBMP.read(reinterpret_cast<char*>(&bmpInfo.bitCount), 2);
-    // std::cout << "Bits per pixel: " << bmpInfo.bitCount << std::endl;
+    size_t width = format.width;
+    size_t height = format.height;
+    size_t rowBytes = width * format.bytesPerPixel;
+    size_t rowStride = format.srcStride;
 
-    readBMP.read(reinterpret_cast<char*>(&bmpInfo.compression), 4);
-    // std::cout << "Compression method: " << bmpInfo.compression << std::endl;
+    output.resize(width, height, pool);
 
-    readBMP.read(reinterpret_cast<char*>(&bmpInfo.imageSize), 4);
-    // std::cout << "Image Size: " << bmpInfo.imageSize << std::endl;
+    size_t rowsPerRead = std::max<size_t>(1, DECODE_STRIP_BYTES / rowStride);
+    std::vector<uint8_t> strip(rowsPerRead * rowStride);
 
-    readBMP.read(reinterpret_cast<char*>(&bmpInfo.xPixelsPerm), 4);
-    // std::cout << "Horizontal Resolution: " << bmpInfo.xPixelsPerm << std::endl;
+    readBMP.clear();
+    readBMP.seekg(bmpFile.dataOffset, std::ios::beg);
 
-    readBMP.read(reinterpret_cast<char*>(&bmpInfo.yPixelsPerm), 4);
-    // std::cout << "Vertical Resolution: " << bmpInfo.yPixelsPerm << std::endl;
+    for(size_t row = 0; row < height; row += rowsPerRead){
+        size_t rows = std::min(rowsPerRead, height - row);
 
-    readBMP.read(reinterpret_cast<char*>(&bmpInfo.colorsUsed), 4);
-    // std::cout << "Colors used: " << bmpInfo.colorsUsed << std::endl;
+        readBMP.read(reinterpret_cast<char*>(strip.data()), rows * rowStride);
+        // Some writers drop the padding after the last row, so only the pixel bytes are required.
+        if((size_t)readBMP.gcount() < (rows - 1) * rowStride + rowBytes){
+            std::cerr << "Error: Unexpected end of pixel data" << std::endl;
+            exit(1);
+        }
+        readBMP.clear();
+
+        // File rows [row, row + rows) are image rows counted from the bottom unless the file is top-down.
+        int firstRow = format.topDown ? height - row - rows : row;
+        decodeBMPRows(format, strip.data(), rows, output, firstRow);
+    }
+}
 
-    readBMP.read(reinterpret_cast<char*>(&bmpInfo.colorsImportant), 4);
-    // std::cout << "Important colors: " << bmpInfo.colorsImportant << std::endl;
+// Reads size bytes at offset, retrying short reads; returns how many bytes there were before EOF.
+static size_t preadFully(int fd, uint8_t* data, size_t size, off_t offset){
+    size_t done = 0;
+    while(done < size){
+        ssize_t got = pread(fd, data + done, size - done, offset + done);
+        if(got < 0 && errno == EINTR)
+            continue;
+        if(got <= 0)
+            break;
+        done += got;
+    }
+    return done;
+}
 
-    RGB rgb;
-    RGBf rgbf;
-    std::vector<RGB> pixels;
-    std::vector<RGBf> normalizedpixels;
+// Parallel variant of decodeBMPPixels() (--pread). Rows have a fixed stride, so every file row's
+// offset follows from dataOffset; each tile of file rows is pread() by the worker that runs it into
+// its own band buffer and decoded right there, with no shared stream position to serialize on.
+// Workers first touch the plane rows they decode.
+void preadBMPPixels(const char* path, const BMPFileHeader& bmpFile, const BMPFormat& format, PlanarImage& output,
+                    ThreadPool& pool){
+    int fd = open(path, O_RDONLY);
+    if(fd < 0){
+        std::cerr << "Error: Cannot open file " << path << std::endl;
+        exit(1);
+    }
 
-    int padding = (4 - (bmpInfo.width * 3) % 4) % 4; // bmpInfo.width are pixels. Each pixel has 3 bytes.
-    for (int i = 0; i < bmpInfo.height; i++){
-        for(int j = 0; j < bmpInfo.width; j++){
+    int height = format.height;
+    size_t rowBytes = (size_t)format.width * format.bytesPerPixel;
+    size_t rowStride = format.srcStride;
+
+    output.resize(format.width, height, &pool);
+    std::vector<std::vector<uint8_t>> bands(pool.size());
+    std::atomic<bool> truncated(false);
+
+    pool.parallelFor(pool.tileCount(height), [&](int tile, int worker){
+        int start = pool.tileStart(tile);
+        int end = pool.tileEnd(tile, height);
+        size_t rows = end - start;
+
+        std::vector<uint8_t>& band = bands[worker];
+        band.resize(rows * rowStride);
+        size_t got = preadFully(fd, band.data(), band.size(), bmpFile.dataOffset + start * rowStride);
+        // Some writers drop the padding after the last row, so only the pixel bytes are required.
+        if(got < (rows - 1) * rowStride + rowBytes){
+            truncated = true;
+            return;
+        }
 
-            readBMP.read(reinterpret_cast<char*>(&rgb.b), 1);
-            rgbf.b = static_cast<float>(rgb.b) / 255.0f;
+        // File rows [start, end) are image rows counted from the bottom unless the file is top-down.
+        int firstRow = format.topDown ? height - end : start;
+        decodeBMPRows(format, band.data(), rows, output, firstRow);
+    });
+    close(fd);
 
-            readBMP.read(reinterpret_cast<char*>(&rgb.g), 1);
-            rgbf.g = static_cast<float>(rgb.g) / 255.0f;
+    if(truncated){
+        std::cerr << "Error: Unexpected end of pixel data" << std::endl;
+        exit(1);
+    }
+}
 
-            readBMP.read(reinterpret_cast<char*>(&rgb.r), 1);
-            rgbf.r = static_cast<float>(rgb.r) / 255.0f;
+// Reads the whole padded pixel array with a single read() (used by the fused pipeline,
+// whose workers decode their own bands). Anything but 24-bit bottom-up is converted to it.
+void readBMPPixelArray(std::istream& readBMP, const BMPFileHeader& bmpFile, const BMPFormat& format, std::vector<uint8_t>& rawPixels){
 
-            pixels.push_back(rgb);
-            normalizedpixels.push_back(rgbf);
-        }
-        readBMP.seekg(padding, std::ios::cur); // skips the padding at the end of the RGB row
+    size_t rowStride = bmpRowStride(format.width);
+    size_t height = format.height;
+    size_t srcStride = format.srcStride;
+
+    std::vector<uint8_t> filePixels;
+    std::vector<uint8_t>& readBuffer = format.canonical() ? rawPixels : filePixels;
+    rawPixels.resize(rowStride * height);
+    readBuffer.resize(srcStride * height);
+
+    readBMP.clear();
+    readBMP.seekg(bmpFile.dataOffset, std::ios::beg);
+    readBMP.read(reinterpret_cast<char*>(readBuffer.data()), readBuffer.size());
+    if((size_t)readBMP.gcount() < (height - 1) * srcStride + (size_t)format.width * format.bytesPerPixel){
+        std::cerr << "Error: Unexpected end of pixel data" << std::endl;
+        exit(1);
     }
+    readBMP.clear();
 
-    float logSum = 0.0f;
-    float delta = 1e-4f;
-    RGBf luminanceWeights = {0.2126f, 0.7152f, 0.0722f};
+    if(!format.canonical())
+        convertBMPRows(format, filePixels.data(), height, rawPixels.data(), rowStride);
+}
 
-    int totalPixels = bmpInfo.height * bmpInfo.width;
+// Writes the headers and an already padded BGR pixel array with one write() each.
+// The pixel array directly follows the headers, so the offsets are rewritten.
+void writeBMPPixelArray(std::ostream& writeBMP, const BMPFileHeader& bmpFile, const BMPInfoHeader& bmpInfo,
+                        const BMPPixelArray& pixelArray){
+    BMPFileHeader outFile = bmpFile;
+    outFile.dataOffset = BMP_HEADER_SIZE;
+    outFile.fileSize = BMP_HEADER_SIZE + pixelArray.size();
 
-    for(int i = 0; i < totalPixels; i++){
+    uint8_t headers[BMP_HEADER_SIZE];
+    serializeBMPHeaders(headers, outFile, outputInfoHeader(bmpInfo));
 
-        float luminance = luminanceWeights.b * normalizedpixels[i].b + 
-        luminanceWeights.g * normalizedpixels[i].g + 
-        luminanceWeights.r * normalizedpixels[i].r;
-        logSum += log(delta + luminance);
+    writeBMP.write(reinterpret_cast<const char*>(headers), BMP_HEADER_SIZE);
+    writeBMP.write(reinterpret_cast<const char*>(pixelArray.data()), pixelArray.size());
+    if(!writeBMP){
+        std::cerr << "Error: Cannot write output file" << std::endl;
+        exit(1);
     }
+}
 
-    float logAvgLuminance = exp(logSum / (float)totalPixels);
+// BMP headers for a freshly created 24-bit bottom-up image.
+void makeBMPHeaders(int width, int height, BMPFileHeader& bmpFile, BMPInfoHeader& bmpInfo){
+    memset(&bmpFile, 0, sizeof(bmpFile));
+    memset(&bmpInfo, 0, sizeof(bmpInfo));
+    memcpy(bmpFile.signature, "BM", 3);
+    bmpInfo.headerSize = 40;
+    bmpInfo.width = width;
+    bmpInfo.height = height;
+    bmpInfo.planes = 1;
+    bmpInfo.bitCount = 24;
+    bmpInfo.xPixelsPerm = 2835;
+    bmpInfo.yPixelsPerm = 2835;
+}
 
-    float exposureKey = std::stof(argv[3]);
+// Writes mapped pixels (row 0 at the bottom) to a new 24-bit BMP at path.
+void writeBMPImage(const char* path, const RGBBuffer& pixels, int width, int height, ThreadPool& pool){
+    BMPPixelArray outputRows;
+    encodeBMPPixelArray(pixels, width, height, outputRows, pool);
 
-    int numThreads = std::stoi(argv[4]);
+    std::ofstream writeBMP(path, std::ios::binary);
+    if(!writeBMP){
+        std::cerr << "Error: Cannot open file " << path << std::endl;
+        exit(1);
+    }
 
-    std::cout << logAvgLuminance << std::endl;
+    BMPFileHeader bmpFile;
+    BMPInfoHeader bmpInfo;
+    makeBMPHeaders(width, height, bmpFile, bmpInfo);
+    writeBMPPixelArray(writeBMP, bmpFile, bmpInfo, outputRows);
+}
 
+// ./tone --bench-decode [SRC imagename] [iterations] [threads]
+// Times header parsing plus decodeBMPPixels() alone, then preadBMPPixels() on a pool of threads workers
+// (default: one per hardware thread), and reports throughput over the padded pixel array.
+void benchDecode(int argc, char *argv[]){
+    if(argc < 3 || argc > 5){
+        std::cout << "./tone --bench-decode [SRC imagename] [iterations] [threads]" << std::endl;
+        exit(1);
+    }
 
-    // Prepare output pixel array
-std::vector<RGB> outputPixels(totalPixels);
+    int iterations = (argc >= 4) ? std::atoi(argv[3]) : 10;
+    if(iterations <= 0){
+        std::cout << argv[3] << " is not a valid number of iterations." << std::endl;
+        exit(1);
+    }
+    int threads = (argc == 5) ? std::atoi(argv[4]) : std::max(1u, std::thread::hardware_concurrency());
+    if(threads <= 0){
+        std::cout << argv[4] << " is not a valid number of threads." << std::endl;
+        exit(1);
+    }
 
-// Create and launch threads
-std::vector<std::thread> threads;
-int chunkSize = totalPixels / numThreads;
+    ThreadPool pool(threads);
+    size_t pixelBytes = 0;
+    PlanarImage pixels;
+
+    for(bool usePread : {false, true}){
+        double best = 0.0;
+        double total = 0.0;
+
+        for(int i = 0; i < iterations; i++){
+            auto start = std::chrono::steady_clock::now();
+
+            std::ifstream readBMP(argv[2], std::ios::binary);
+            if(!readBMP){
+                std::cerr << "Error: Cannot open file " << argv[2] << std::endl;
+                exit(1);
+            }
+            BMPFileHeader bmpFile;
+            BMPInfoHeader bmpInfo;
+            readBMPHeaders(readBMP, bmpFile, bmpInfo);
+            BMPFormat format = readBMPFormat(readBMP, bmpInfo);
+            if(usePread)
+                preadBMPPixels(argv[2], bmpFile, format, pixels, pool);
+            else
+                decodeBMPPixels(readBMP, bmpFile, format, pixels);
+
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+            pixelBytes = format.srcStride * format.height;
+            double mbPerSec = pixelBytes / (1024.0 * 1024.0) / elapsed.count();
+            best = std::max(best, mbPerSec);
+            total += mbPerSec;
+        }
 
-for (int i = 0; i < numThreads; i++) {
-    int startIdx = i * chunkSize;
-    int endIdx = (i == numThreads - 1) ? totalPixels : (i + 1) * chunkSize;
-    
-    threads.push_back(std::thread(processChunk, startIdx, endIdx, std::ref(normalizedpixels), 
-                                 std::ref(outputPixels), logAvgLuminance, exposureKey));
+        if(!usePread)
+            std::cout << "Decoded " << pixelBytes << " bytes x " << iterations << " iterations" << std::endl;
+        std::cout << (usePread ? "pread, " + std::to_string(threads) + " threads" : std::string("fstream"))
+                  << " decode throughput: best " << best << " MB/s, average " << total / iterations << " MB/s" << std::endl;
+    }
 }
 
-// Join all threads
-for (auto& thread : threads) {
-    thread.join();
+// Maps the whole file read-only.
+MappedFile mapFileRead(const char* path){
+    MappedFile file;
+
+    file.fd = open(path, O_RDONLY);
+    if(file.fd < 0){
+        std::cerr << "Error: Cannot open file " << path << std::endl;
+        exit(1);
+    }
+
+    struct stat st;
+    if(fstat(file.fd, &st) < 0 || st.st_size == 0){
+        std::cerr << "Error: Cannot stat file " << path << std::endl;
+        exit(1);
+    }
+    file.size = st.st_size;
+
+    void* data = mmap(nullptr, file.size, PROT_READ, MAP_SHARED, file.fd, 0);
+    if(data == MAP_FAILED){
+        std::cerr << "Error: Cannot map file " << path << std::endl;
+        exit(1);
+    }
+    file.data = static_cast<uint8_t*>(data);
+
+    // Every pixel is touched once front to back
+    madvise(data, file.size, MADV_SEQUENTIAL);
+
+    return file;
 }
 
-// Write the BMP headers to output file
-writeBMP.write(reinterpret_cast<char*>(&bmpFile.signature), 2);
-writeBMP.write(reinterpret_cast<char*>(&bmpFile.fileSize), 4);
-writeBMP.write(reinterpret_cast<char*>(&bmpFile.reserved1), 2);
-writeBMP.write(reinterpret_cast<char*>(&bmpFile.reserved2), 2);
-writeBMP.write(reinterpret_cast<char*>(&bmpFile.dataOffset), 4);
-
-writeBMP.write(reinterpret_cast<char*>(&bmpInfo.headerSize), 4);
-writeBMP.write(reinterpret_cast<char*>(&bmpInfo.width), 4);
-writeBMP.write(reinterpret_cast<char*>(&bmpInfo.height), 4);
-writeBMP.write(reinterpret_cast<char*>(&bmpInfo.planes), 2);
-writeBMP.write(reinterpret_cast<char*>(&bmpInfo.bitCount), 2);
-writeBMP.write(reinterpret_cast<char*>(&bmpInfo.compression), 4);
-writeBMP.write(reinterpret_cast<char*>(&bmpInfo.imageSize), 4);
-writeBMP.write(reinterpret_cast<char*>(&bmpInfo.xPixelsPerm), 4);
-writeBMP.write(reinterpret_cast<char*>(&bmpInfo.yPixelsPerm), 4);
-writeBMP.write(reinterpret_cast<char*>(&bmpInfo.colorsUsed), 4);
-writeBMP.write(reinterpret_cast<char*>(&bmpInfo.colorsImportant), 4);
-
-// Write pixel data with padding
-char paddingBytes[3] = {0, 0, 0}; // Up to 3 bytes of padding
-
-for (int i = 0; i < bmpInfo.height; i++) {
-    for (int j = 0; j < bmpInfo.width; j++) {
-        int pixelIndex = i * bmpInfo.width + j;
-        
-        // Write BGR (not RGB) order as per BMP format
-        writeBMP.write(reinterpret_cast<char*>(&outputPixels[pixelIndex].b), 1);
-        writeBMP.write(reinterpret_cast<char*>(&outputPixels[pixelIndex].g), 1);
-        writeBMP.write(reinterpret_cast<char*>(&outputPixels[pixelIndex].r), 1);
+// Creates (or truncates) the file, sizes it and maps it writable.
+MappedFile mapFileWrite(const char* path, size_t size){
+    MappedFile file;
+
+    file.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(file.fd < 0){
+        std::cerr << "Error: Cannot open file " << path << std::endl;
+        exit(1);
     }
-    
-    // Write padding bytes at the end of each row
-    if (padding > 0) {
-        writeBMP.write(paddingBytes, padding);
+    if(ftruncate(file.fd, size) < 0){
+        std::cerr << "Error: Cannot resize file " << path << std::endl;
+        exit(1);
     }
+    file.size = size;
+
+    void* data = mmap(nullptr, file.size, PROT_READ | PROT_WRITE, MAP_SHARED, file.fd, 0);
+    if(data == MAP_FAILED){
+        std::cerr << "Error: Cannot map file " << path << std::endl;
+        exit(1);
+    }
+    file.data = static_cast<uint8_t*>(data);
+
+    return file;
 }
 
+void unmapFile(MappedFile& file){
+    munmap(file.data, file.size);
+    close(file.fd);
+    file.data = nullptr;
+    file.fd = -1;
+}
+
+// Zero-copy variant of toneMap(). The source pixels are read straight out of the page cache
+// and every worker writes its rows straight into the mapped target file, so no decoded or
+// output pixel buffers are allocated.
+float toneMapMmap(const ToneOptions& options, ThreadPool& pool){
+
+    StageTimer stage(&pool);
+    stage.begin("header parse");
+    MappedFile src = mapFileRead(options.srcPath);
+
+    if(src.size < BMP_HEADER_SIZE){
+        std::cerr << "Error: File is too small to be a BMP" << std::endl;
+        exit(1);
+    }
+
+    BMPFileHeader bmpFile;
+    BMPInfoHeader bmpInfo;
+    parseBMPHeaders(src.data, bmpFile, bmpInfo);
+
+    uint8_t maskBytes[BMP_MASKS_SIZE] = {0};
+    memcpy(maskBytes, src.data + BMP_HEADER_SIZE, std::min(BMP_MASKS_SIZE, src.size - BMP_HEADER_SIZE));
+    BMPFormat format = bmpFormat(bmpInfo, maskBytes);
+
+    int width = format.width;
+    int height = format.height;
+    size_t rowStride = bmpRowStride(width);
+    size_t srcStride = format.srcStride;
+
+    if(bmpFile.dataOffset > src.size ||
+       src.size - bmpFile.dataOffset < (height - 1) * srcStride + (size_t)width * format.bytesPerPixel){
+        std::cerr << "Error: Unexpected end of pixel data" << std::endl;
+        exit(1);
+    }
+    const uint8_t* srcPixels = src.data + bmpFile.dataOffset;
+    size_t totalPixels = (size_t)width * height;
+    // Pages of the mapping are read on first touch, by whichever stage reads the pixels first.
+    size_t pixelBytes = srcStride * height;
+    stage.count(bmpFile.dataOffset, 0, 0);
+
+    // Other formats are converted to 24-bit bottom-up rows first, which gives up the zero-copy read.
+    std::vector<uint8_t> converted;
+    if(!format.canonical()){
+        stage.begin("convert");
+        stage.count(pixelBytes, 0, totalPixels);
+        pixelBytes = 0;
+        converted.resize(rowStride * height);
+        pool.parallelFor(pool.tileCount(height), [&](int tile, int){
+            int startRow = pool.tileStart(tile);
+            int endRow = pool.tileEnd(tile, height);
+            convertBMPRows(format, srcPixels + firstFileRow(format, startRow, endRow) * srcStride, endRow - startRow,
+                           converted.data() + startRow * rowStride, rowStride);
+        });
+        srcPixels = converted.data();
+    }
+
+    // The pixel array is written right after the headers, so the offsets are rewritten.
+    BMPFileHeader outFile = bmpFile;
+    BMPInfoHeader outInfo = outputInfoHeader(bmpInfo);
+    outFile.dataOffset = BMP_HEADER_SIZE;
+    outFile.fileSize = BMP_HEADER_SIZE + rowStride * height;
+
+    // ftruncate() zero fills, so the row padding needs no writes.
+    stage.begin("map output");
+    MappedFile dst = mapFileWrite(options.targetPath, outFile.fileSize);
+    serializeBMPHeaders(dst.data, outFile, outInfo);
+    uint8_t* dstPixels = dst.data + BMP_HEADER_SIZE;
+
+    float logAvgLuminance;
+
+    if(options.useLUT){
+        stage.begin("lut map");
+        logAvgLuminance = toneMapLUT(srcPixels, rowStride, dstPixels, rowStride, width, height,
+                                     options.exposureKey, pool, options.luminanceCache);
+        stage.count(pixelBytes, outFile.fileSize, totalPixels);
+    }
+    else {
+        stage.begin("luminance");
+        float exposureKey = options.exposureKey;
+        bool autoExposure = exposureKey == 0.0f;
+        logAvgLuminance = cachedLogAverage(options.luminanceCache, LUMINANCE_SLOT_FLOAT, [&]{
+            if(!autoExposure)
+                return logAverageLuminanceRows(srcPixels, width, height, rowStride, pool);
+
+            std::vector<uint64_t> histogram;
+            float logAverage = logAverageLuminanceRows(srcPixels, width, height, rowStride, pool, &histogram);
+            exposureKey = autoExposureKey(logAverage, histogram);
+            return logAverage;
+        }, autoExposure ? &exposureKey : nullptr);
+        stage.count(pixelBytes, 0, totalPixels);
+
+        stage.begin("map");
+        pool.parallelFor(pool.tileCount(height), [&](int tile, int){
+            processRows(pool.tileStart(tile), pool.tileEnd(tile, height), width, srcPixels, rowStride,
+                        dstPixels, rowStride, logAvgLuminance, exposureKey);
+        });
+        stage.count(0, outFile.fileSize, totalPixels);
+    }
 
-readBMP.close();
-writeBMP.close();
+    stage.begin("unmap");
+    unmapFile(src);
+    unmapFile(dst);
 
-std::cout << "Tone mapping completed successfully." << std::endl;
+    return logAvgLuminance;
+}
 
+// The sized constructor and resize() exit when the planes cannot be allocated, so they stay out of
+// toneCore.cpp; libtonemap uses tryResize().
+PlanarImage::PlanarImage(size_t width, size_t height) : PlanarImage() {
+    resize(width, height);
+}
 
+// Keeps the allocation if it is already large enough. Contents are not preserved.
+void PlanarImage::resize(size_t newWidth, size_t newHeight, ThreadPool* pool){
+    if(!tryResize(newWidth, newHeight, pool)){
+        std::cerr << "Error: Cannot allocate " << newWidth << "x" << newHeight << " image" << std::endl;
+        exit(1);
+    }
 }
 
+// Decodes interleaved BGR rows into normalized floats and sums log(delta + L) in the same sweep.
+void decodeRows(int startRow, int endRow, int width, const uint8_t* src, size_t srcStride,
+                PlanarImage& output, double& partialSum){
+    const float* normalize = normalizationLUT();
+    double logSum = 0.0;
+    size_t out = (size_t)startRow * width;
+
+    for(int i = startRow; i < endRow; i++){
+        const uint8_t* in = src + i * srcStride;
+        for(int j = 0; j < width; j++){
+            RGBf pixel = {normalize[in[2]], normalize[in[1]], normalize[in[0]]};
+            output.r[out] = pixel.r;
+            output.g[out] = pixel.g;
+            output.b[out] = pixel.b;
+            logSum += std::log((double)(LUMINANCE_DELTA + pixelLuminance(pixel)));
+            in += 3;
+            out++;
+        }
+    }
+    partialSum = logSum;
+}
 
-// Function to apply Reinhard tone mapping to a pixel
-RGBf toneMapReinhard(RGBf color, float avgLum, float a) {
-    // Calculate luminance
-    RGBf luminanceWeights = {0.2126f, 0.7152f, 0.0722f};
-    float L = luminanceWeights.r * color.r + luminanceWeights.g * color.g + luminanceWeights.b * color.b;
-    
-    // Scale luminance based on exposure key
-    float L_scaled = (a / avgLum) * L;
-    
-    // Apply Reinhard tone mapping
-    float L_mapped = L_scaled / (1.0f + L_scaled);
-    
+// Fused pipeline: every tile is decoded and its partial log luminance accumulated in one sweep.
+// Once parallelFor() returns all partial sums are in, and the second parallelFor() deals the
+// tiles out the same way, so unless a tile was stolen each worker maps the rows it just decoded
+// while they are still in cache. Returns the log-average luminance.
+float toneMapFused(const uint8_t* rawPixels, size_t srcStride, int width, int height,
+                   RGBBuffer& outputPixels, float exposureKey, ThreadPool& pool){
+    size_t totalPixels = (size_t)width * height;
+    PlanarImage normalizedpixels;
+    normalizedpixels.resize(width, height, &pool);
+    std::vector<double> tileSums(pool.tileCount(height), 0.0);
+
+    outputPixels.resize(totalPixels);
+
+    pool.parallelFor(tileSums.size(), [&](int tile, int){
+        decodeRows(pool.tileStart(tile), pool.tileEnd(tile, height), width, rawPixels, srcStride,
+                   normalizedpixels, tileSums[tile]);
+    });
+
+    double logSum = 0.0;
+    for(double tileSum : tileSums){
+        logSum += tileSum;
+    }
+    float logAvgLuminance = (float)std::exp(logSum / totalPixels);
 
-    if (L < 1e-5f) return {0.0f, 0.0f, 0.0f};
-    
-    // Preserve color ratio (preserves chrominance)
-    RGBf result;
-    result.r = color.r * (L_mapped / L);
-    result.g = color.g * (L_mapped / L);
-    result.b = color.b * (L_mapped / L);
-    
-    return result;
+    pool.parallelFor(tileSums.size(), [&](int tile, int){
+        processChunk((size_t)pool.tileStart(tile) * width, (size_t)pool.tileEnd(tile, height) * width, normalizedpixels,
+                     outputPixels, logAvgLuminance, exposureKey);
+    });
+
+    return logAvgLuminance;
+}
+
+// --tile-stats: per-tile timing histogram of every parallelFor() in the run.
+void printTileTimings(const TileTimings& timings){
+    std::cout << "Tiles: " << timings.tiles << ", stolen: " << timings.steals
+              << ", mean " << (timings.tiles ? timings.totalSeconds / timings.tiles * 1e6 : 0.0) << " us"
+              << ", max " << timings.maxSeconds * 1e6 << " us" << std::endl;
+
+    for(int i = 0; i < TILE_TIMING_BUCKETS; i++){
+        if(timings.buckets[i] == 0)
+            continue;
+        std::cout << "  " << (i == 0 ? 0 : (1ull << i)) << "-" << (1ull << (i + 1)) << " us: " << timings.buckets[i] << std::endl;
+    }
 }
 
-// Function that will be executed by each thread
-void processChunk(int startIdx, int endIdx, const std::vector<RGBf>& input, 
-                 std::vector<RGB>& output, float avgLum, float exposureKey) {
-    for (int i = startIdx; i < endIdx; i++) {
-        // Apply tone mapping
-        RGBf mappedPixel = toneMapReinhard(input[i], avgLum, exposureKey);
-        
-        // Denormalize back to 0-255 range
-        RGB outPixel;
-        outPixel.r = static_cast<uint8_t>(std::min(std::max(mappedPixel.r * 255.0f, 0.0f), 255.0f));
-        outPixel.g = static_cast<uint8_t>(std::min(std::max(mappedPixel.g * 255.0f, 0.0f), 255.0f));
-        outPixel.b = static_cast<uint8_t>(std::min(std::max(mappedPixel.b * 255.0f, 0.0f), 255.0f));
-        
-        output[i] = outPixel;
+// Same as processChunk(), but reads and writes interleaved BGR rows in place (used by the mmap path).
+void processRows(int startRow, int endRow, int width, const uint8_t* src, size_t srcStride,
+                 uint8_t* dst, size_t dstStride, float avgLum, float exposureKey) {
+    const float* normalize = normalizationLUT();
+    const int32_t* encode = outputEncodeLUT();
+    bool exact = deterministicMode();
+    float maxOutput = encode ? SRGB_ENCODE_SIZE - 1 : 255.0f;
+    float scale = exposureKey / avgLum;
+    float scaleMax = scale * maxOutput;
+
+    for (int i = startRow; i < endRow; i++) {
+        const uint8_t* in = src + i * srcStride;
+        uint8_t* out = dst + i * dstStride;
+
+        for (int j = 0; j < width; j++) {
+            RGBf pixel = {normalize[in[2]], normalize[in[1]], normalize[in[0]]};
+            RGB outPixel;
+            if (exact) {
+                outPixel = toneMapExact(pixel, scale, scaleMax, maxOutput, encode);
+            }
+            else {
+                RGBf mapped = toneMapReinhard(pixel, avgLum, exposureKey);
+                outPixel = encode ? toSRGBOutputPixel(mapped, encode) : toOutputPixel(mapped);
+            }
+
+            out[0] = outPixel.b;
+            out[1] = outPixel.g;
+            out[2] = outPixel.r;
+            in += 3;
+            out += 3;
+        }
     }
 }
 
-void argCheck(int argc, char *argv[]){
+ToneOptions argCheck(int argc, char *argv[]){
     int error = 0;
-    if(argc != 5){
-        std::cout << "./tone [SRC imagename] [TARGET imagename] [exposure_key] [number of threads]" << std::endl;
+
+    // --batch and --sequence shift the positional arguments by one
+    bool batch = argc >= 2 && strcmp(argv[1], "--batch") == 0;
+    bool sequence = argc >= 2 && strcmp(argv[1], "--sequence") == 0;
+    int first = batch || sequence ? 2 : 1;
+
+    // With --sweep the key list replaces [exposure_key], which may then be left out: the positional
+    // arguments end at the first option.
+    bool sweep = false;
+    for (int i = first; i < argc; i++){
+        if (strcmp(argv[i], "--sweep") == 0)
+            sweep = true;
+    }
+    bool keyGiven = !sweep || (argc > first + 3 && strncmp(argv[first + 3], "--", 2) != 0);
+    int positionals = keyGiven ? 4 : 3;
+
+    if(argc < first + positionals){
+        std::cout << "./tone [SRC imagename|.pfm|.hdr] [TARGET imagename] [exposure_key|auto] [number of threads] [--mmap] [--pread] [--fused] [--lut] [--kernel scalar|sse4.1|avx2|auto] [--tile-rows N] [--tile-stats] [--pin] [--stream MB] [--operator global|extended|local] [--white L] [--srgb] [--deterministic] [--sweep k1,k2,...] [--stats-cache] [--stats text|json]" << std::endl;
+        std::cout << "./tone [SRC imagename|.pfm|.hdr] [TARGET imagename] [number of threads] --sweep k1,k2,... [options]" << std::endl;
+        std::cout << "./tone --batch [SRC directory|manifest] [TARGET directory] [exposure_key|auto] [number of threads] [options]" << std::endl;
+        std::cout << "./tone --sequence [SRC directory|manifest] [TARGET directory] [exposure_key|auto] [number of threads] [--adapt frames] [options]" << std::endl;
         exit(1);
     }
+
+    ToneOptions options;
+    options.srcPath = argv[first];
+    options.targetPath = argv[first + 1];
+    options.batch = batch;
+    options.sequence = sequence;
+    options.adaptFrames = 8.0f;
+    bool adaptSet = false;
+    options.exposureKey = 0.0f;
+    options.numThreads = 1;
+    options.useMmap = false;
+    options.usePread = false;
+    options.fused = false;
+    options.kernelISA = ISA_AUTO;
+    options.useLUT = false;
+    options.tileRows = DEFAULT_TILE_ROWS;
+    options.tileStats = false;
+    options.streamBytes = 0;
+    options.toneOperator = OPERATOR_GLOBAL;
+    options.whitePoint = 0.0f;
+    options.transfer = TRANSFER_LINEAR;
+    options.deterministic = false;
+    options.statsCache = false;
+    options.luminanceCache = nullptr;
+    options.stats = STATS_OFF;
+    options.pinThreads = false;
     
-    // Checks that SRC imagename and TARGET imagename are .bmp files.
-    for (int i = 1; i <= 2; i++){
+    // Checks that SRC imagename and TARGET imagename are .bmp files (SRC may also be .pfm or .hdr).
+    for (int i = 1; i <= 2 && !batch && !sequence; i++){
         char *filename = argv[i];
 
+        if (i == 1 && isHDRPath(filename))
+            continue;
         if (strlen(argv[i]) < 4 || (strcmp(&filename[strlen(argv[i]) - 4], ".bmp") != 0) ){
             std::cout << argv[i] << " is not a bmp file." << std::endl;
             error = 1;
         }
     }
-    // checks that the [exposure_key] is a float
-    try {
-        float exposure_key = std::stof(argv[3]);
-    } 
-    catch (const std::invalid_argument& e) {
-        std::cout << argv[3] << " is not a valid float." << std::endl;
-        error = 1;
-    } 
-    catch (const std::out_of_range& e) {
-        std::cout << argv[3] << " is out of range for a float." << std::endl;
-        error = 1;
+    char *keyArg = keyGiven ? argv[first + 2] : nullptr;
+    char *threadsArg = argv[first + positionals - 1];
+
+    // checks that the [exposure_key] is a float, or "auto" (stored as 0). Without one (--sweep) it is
+    // never used, every sweep key replaces it.
+    if (!keyGiven)
+        options.exposureKey = 0.18f;
+    else {
+        try {
+            options.exposureKey = strcmp(keyArg, "auto") == 0 ? 0.0f : std::stof(keyArg);
+            if (options.exposureKey < 0.0f || (options.exposureKey == 0.0f && strcmp(keyArg, "auto") != 0)){
+                std::cout << "[exposure_key] must be positive or auto." << std::endl;
+                error = 1;
+            }
+        } 
+        catch (const std::invalid_argument& e) {
+            std::cout << keyArg << " is not a valid float." << std::endl;
+            error = 1;
+        } 
+        catch (const std::out_of_range& e) {
+            std::cout << keyArg << " is out of range for a float." << std::endl;
+            error = 1;
+        }
     }
 
     // Check to make sure [number of threads] is an int.
-    for (int j = 0; j < strlen(argv[4]); j++)
+    for (size_t j = 0; j < strlen(threadsArg); j++)
 
-        if ('0' > argv[4][j] || argv[4][j] > '9'){
-            std::cout << argv[4] << " is not a number." << std::endl;
+        if ('0' > threadsArg[j] || threadsArg[j] > '9'){
+            std::cout << threadsArg << " is not a number." << std::endl;
             error = 1;
             break;
         }
 
+    if (!error){
+        options.numThreads = std::atoi(threadsArg);
+        if (options.numThreads < 1){
+            std::cout << "[number of threads] must be at least 1." << std::endl;
+            error = 1;
+        }
+    }
+
+    // Optional flags after the positional arguments
+    for (int i = first + positionals; i < argc; i++){
+        if (strcmp(argv[i], "--mmap") == 0)
+            options.useMmap = true;
+        else if (strcmp(argv[i], "--pread") == 0)
+            options.usePread = true;
+        else if (strcmp(argv[i], "--fused") == 0)
+            options.fused = true;
+        else if (strcmp(argv[i], "--lut") == 0)
+            options.useLUT = true;
+        else if (strcmp(argv[i], "--tile-stats") == 0)
+            options.tileStats = true;
+        else if (strcmp(argv[i], "--pin") == 0)
+            options.pinThreads = true;
+        else if (strcmp(argv[i], "--stats-cache") == 0)
+            options.statsCache = true;
+        else if (strcmp(argv[i], "--srgb") == 0)
+            options.transfer = TRANSFER_SRGB;
+        else if (strcmp(argv[i], "--deterministic") == 0)
+            options.deterministic = true;
+        else if (strcmp(argv[i], "--tile-rows") == 0 && i + 1 < argc){
+            options.tileRows = std::atoi(argv[++i]);
+            if (options.tileRows < 1){
+                std::cout << argv[i] << " is not a valid number of tile rows." << std::endl;
+                error = 1;
+            }
+        }
+        else if (strcmp(argv[i], "--stream") == 0 && i + 1 < argc){
+            int megabytes = std::atoi(argv[++i]);
+            if (megabytes < 1){
+                std::cout << argv[i] << " is not a valid strip budget in MB." << std::endl;
+                error = 1;
+            }
+            options.streamBytes = (size_t)std::max(megabytes, 0) * 1024 * 1024;
+        }
+        else if (strcmp(argv[i], "--operator") == 0 && i + 1 < argc){
+            i++;
+            if (strcmp(argv[i], "global") == 0)
+                options.toneOperator = OPERATOR_GLOBAL;
+            else if (strcmp(argv[i], "extended") == 0)
+                options.toneOperator = OPERATOR_EXTENDED;
+            else if (strcmp(argv[i], "local") == 0)
+                options.toneOperator = OPERATOR_LOCAL;
+            else {
+                std::cout << argv[i] << " is not a valid operator (global, extended, local)." << std::endl;
+                error = 1;
+            }
+        }
+        else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc){
+            i++;
+            if (strcmp(argv[i], "text") == 0)
+                options.stats = STATS_TEXT;
+            else if (strcmp(argv[i], "json") == 0)
+                options.stats = STATS_JSON;
+            else {
+                std::cout << argv[i] << " is not a valid stats format (text, json)." << std::endl;
+                error = 1;
+            }
+        }
+        else if (strcmp(argv[i], "--sweep") == 0 && i + 1 < argc){
+            std::string list = argv[++i];
+            size_t start = 0;
+            while (start <= list.size()){
+                size_t end = std::min(list.find(',', start), list.size());
+                std::string key = list.substr(start, end - start);
+                char *parsedEnd = nullptr;
+                float value = std::strtof(key.c_str(), &parsedEnd);
+                if (key.empty() || *parsedEnd != '\0' || !(value > 0.0f)){
+                    std::cout << key << " is not a valid exposure key." << std::endl;
+                    error = 1;
+                }
+                // Each key names its own TARGET_<k>.bmp, and the keys are mapped concurrently.
+                else if (std::find(options.sweepKeys.begin(), options.sweepKeys.end(), key) != options.sweepKeys.end()){
+                    std::cout << key << " is listed more than once in --sweep." << std::endl;
+                    error = 1;
+                }
+                options.sweepKeys.push_back(key);
+                start = end + 1;
+            }
+        }
+        else if (strcmp(argv[i], "--adapt") == 0 && i + 1 < argc){
+            char *parsedEnd = nullptr;
+            options.adaptFrames = std::strtof(argv[++i], &parsedEnd);
+            adaptSet = true;
+            if (*parsedEnd != '\0' || !(options.adaptFrames >= 0.0f)){
+                std::cout << argv[i] << " is not a valid adaptation time in frames." << std::endl;
+                error = 1;
+            }
+        }
+        else if (strcmp(argv[i], "--white") == 0 && i + 1 < argc){
+            options.whitePoint = std::atof(argv[++i]);
+            if (options.whitePoint <= 0.0f){
+                std::cout << argv[i] << " is not a valid white point." << std::endl;
+                error = 1;
+            }
+        }
+        else if (strcmp(argv[i], "--kernel") == 0 && i + 1 < argc){
+            i++;
+            if (strcmp(argv[i], "scalar") == 0)
+                options.kernelISA = ISA_SCALAR;
+            else if (strcmp(argv[i], "sse4.1") == 0)
+                options.kernelISA = ISA_SSE41;
+            else if (strcmp(argv[i], "avx2") == 0)
+                options.kernelISA = ISA_AVX2;
+            else if (strcmp(argv[i], "auto") != 0){
+                std::cout << argv[i] << " is not a valid kernel (scalar, sse4.1, avx2, auto)." << std::endl;
+                error = 1;
+            }
+        }
+        else {
+            std::cout << argv[i] << " is not a valid option." << std::endl;
+            error = 1;
+        }
+    }
+
+    // The mmap path never decodes into a float buffer, so there is nothing to fuse.
+    if (options.useMmap && options.fused){
+        std::cout << "--mmap and --fused cannot be combined." << std::endl;
+        error = 1;
+    }
+
+    // The LUT path maps the raw bytes directly and never builds the float planes.
+    if (options.useLUT && options.fused){
+        std::cout << "--lut and --fused cannot be combined." << std::endl;
+        error = 1;
+    }
+
+    // Strip mode reads through its own buffers and maps rows directly, like --mmap.
+    if (options.streamBytes != 0 && (options.useMmap || options.fused)){
+        std::cout << "--stream cannot be combined with --mmap or --fused." << std::endl;
+        error = 1;
+    }
+
+    // --pread replaces the fstream decode of the float planes; the other paths read the file their own way.
+    if (options.usePread && (options.useMmap || options.fused || options.useLUT || options.streamBytes != 0 || sequence)){
+        std::cout << "--pread cannot be combined with --mmap, --fused, --lut, --stream or --sequence." << std::endl;
+        error = 1;
+    }
+
+    // The extended and local operators need the whole image as float planes.
+    if (options.toneOperator != OPERATOR_GLOBAL && (options.useMmap || options.fused || options.useLUT || options.streamBytes != 0)){
+        std::cout << "--operator extended|local cannot be combined with --mmap, --fused, --lut or --stream." << std::endl;
+        error = 1;
+    }
+
+    // A sweep shares one decoded float image between all keys.
+    if (!options.sweepKeys.empty() && (batch || options.useMmap || options.fused || options.useLUT || options.streamBytes != 0)){
+        std::cout << "--sweep cannot be combined with --batch, --mmap, --fused, --lut or --stream." << std::endl;
+        error = 1;
+    }
+
+    // The automatic key needs the histogram of the luminance pass, which the fused pass does not fill.
+    if (options.exposureKey == 0.0f && !error && options.fused){
+        std::cout << "auto [exposure_key] cannot be combined with --fused." << std::endl;
+        error = 1;
+    }
+
+    // The LUT path works on the raw bytes, and cached log averages were computed from linear bytes.
+    if (options.transfer == TRANSFER_SRGB && (options.useLUT || options.statsCache)){
+        std::cout << "--srgb cannot be combined with --lut or --stats-cache." << std::endl;
+        error = 1;
+    }
+
+    // The fused pass sums float logs while it decodes, and cached log averages come from such sums.
+    if (options.deterministic && (options.fused || options.statsCache)){
+        std::cout << "--deterministic cannot be combined with --fused or --stats-cache." << std::endl;
+        error = 1;
+    }
+
+    // Stages of concurrently mapped images would overlap in the report.
+    if (options.stats != STATS_OFF && (batch || sequence || !options.sweepKeys.empty())){
+        std::cout << "--stats cannot be combined with --batch, --sequence or --sweep." << std::endl;
+        error = 1;
+    }
+
+    // Sequence frames are decoded from the file bytes by the pool and mapped as float planes.
+    if (sequence && (options.useMmap || options.fused || options.useLUT || options.streamBytes != 0
+                     || !options.sweepKeys.empty() || options.statsCache)){
+        std::cout << "--sequence cannot be combined with --mmap, --fused, --lut, --stream, --sweep or --stats-cache." << std::endl;
+        error = 1;
+    }
+
+    if (adaptSet && !sequence){
+        std::cout << "--adapt only applies to --sequence." << std::endl;
+        error = 1;
+    }
+
+    // HDR input is decoded straight into float planes, none of the 8-bit row paths apply.
+    if (!batch && !sequence && isHDRPath(options.srcPath) && (options.useMmap || options.usePread || options.fused || options.useLUT || options.streamBytes != 0)){
+        std::cout << "--mmap, --pread, --fused, --lut and --stream need BMP input." << std::endl;
+        error = 1;
+    }
+
     if (error)
         exit(1);
 
-}
\ No newline at end of file
+    return options;
+}
@@ -2,6 +2,30 @@
 #define TONE_H
 
 #include <cstdint>
+#include <cstddef>
+#include <istream>
+#include <ostream>
+#include <vector>
+#include <string>
+#include <functional>
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <utility>
+#include "threadPool.h"
+
+// Size of the file header plus the 40-byte info header.
+const size_t BMP_HEADER_SIZE = 54;
+
+// BI_BITFIELDS red, green and blue masks, stored right after the 40-byte info header.
+const size_t BMP_MASKS_SIZE = 12;
+
+// Quantized luminance bins used by the LUT path (see toneLUT.cpp).
+const int LUT_LUMINANCE_BITS = 16;
+const int LUT_LUMINANCE_SIZE = 1 << LUT_LUMINANCE_BITS;
+
+// Pixel rows are read in strips of at most this many bytes.
+const size_t DECODE_STRIP_BYTES = 4 * 1024 * 1024;
 
 #pragma pack(push, 1)
 
@@ -40,10 +64,412 @@ struct RGBf {
     float b;
 };
 
+// On-disk record of the luminance statistics cache, see toneCache.cpp.
+struct LuminanceCacheRecord {
+    char magic[4];
+    uint32_t version;
+    uint64_t fileSize;
+    int64_t mtimeNs;
+    uint64_t sampleHash;
+    uint32_t validSlots;                        // bit i set: slot i (LuminanceSlot) holds a value
+    float logAverage[2];
+    double seconds[2];                          // pre-pass time the slot saves on a hit
+    uint32_t autoKeySlots;                      // bit i set: autoKey[i] holds slot i's automatic key
+    float autoKey[2];
+};
+
 #pragma pack(pop)
+
+// The float paths and the LUT path compute slightly different log averages.
+enum LuminanceSlot {
+    LUMINANCE_SLOT_FLOAT,
+    LUMINANCE_SLOT_LUT
+};
+
+// Cache state of one source file while it is mapped.
+struct LuminanceCacheEntry {
+    LuminanceCacheRecord record;
+    bool keyed;         // the file could be stat()ed and sampled
+    bool dirty;         // a slot was computed and the sidecar needs rewriting
+};
+
+// Report format of --stats.
+enum StatsFormat {
+    STATS_OFF,
+    STATS_TEXT,
+    STATS_JSON
+};
+
+// Wall and CPU time of one pipeline stage for --stats, see toneStats.cpp.
+struct StageRecord {
+    std::string name;
+    double wallSeconds;
+    double cpuSeconds;
+    uint64_t bytesRead;
+    uint64_t bytesWritten;
+    uint64_t pixels;
+    std::vector<double> workerSeconds;  // tile time per pool worker, empty for serial stages
+};
+
+// Set by enableToneStats(); while it is null every StageTimer call is a single pointer test.
+struct ToneStats;
+extern ToneStats* activeToneStats;
+
+// Times consecutive stages: begin() closes the open stage (if any) and opens the next one,
+// end() or the destructor closes the last one. Stages must not nest.
+class StageTimer {
+public:
+    explicit StageTimer(const ThreadPool* pool = nullptr) : pool(pool), open(false) {}
+    ~StageTimer(){ end(); }
+
+    void begin(const char* name){
+        if(activeToneStats != nullptr)
+            beginStage(name);
+    }
+    void count(uint64_t bytesRead, uint64_t bytesWritten, uint64_t pixels){
+        if(open){
+            record.bytesRead += bytesRead;
+            record.bytesWritten += bytesWritten;
+            record.pixels += pixels;
+        }
+    }
+    void end(){
+        if(open)
+            endStage();
+    }
+
+private:
+    void beginStage(const char* name);
+    void endStage();
+
+    const ThreadPool* pool;
+    bool open;
+    StageRecord record;
+    double wallStart;
+    double cpuStart;
+    std::vector<double> workerStart;
+};
+
+// Instruction set used by the Reinhard kernel, ISA_AUTO picks the best one the CPU supports.
+enum KernelISA {
+    ISA_AUTO,
+    ISA_SCALAR,
+    ISA_SSE41,
+    ISA_AVX2
+};
+
+// Transfer function of the 8-bit input and output, see srgbTransfer.cpp.
+enum TransferFunction {
+    TRANSFER_LINEAR,    // bytes are linear values times 255
+    TRANSFER_SRGB       // bytes are sRGB encoded
+};
+
+// Linear output values are quantized to this many bits before the sRGB encode table.
+const int SRGB_ENCODE_BITS = 12;
+const int SRGB_ENCODE_SIZE = 1 << SRGB_ENCODE_BITS;
+
+// Tone curve applied to the float planes, see toneOperators.cpp.
+enum ToneOperator {
+    OPERATOR_GLOBAL,    // L / (1 + L)
+    OPERATOR_EXTENDED,  // L (1 + L / Lwhite^2) / (1 + L)
+    OPERATOR_LOCAL      // dodge-and-burn over a range of Gaussian scales
+};
+
+// Command line settings filled in by argCheck().
+struct ToneOptions {
+    const char* srcPath;
+    const char* targetPath;
+    bool batch;         // --batch: srcPath is a directory or manifest, targetPath an output directory
+    bool sequence;      // --sequence: like --batch, but the images are frames of one clip mapped in order
+    float adaptFrames;  // --adapt: time constant of the log-average adaptation in frames, 0 = none
+    float exposureKey;  // 0 = "auto": chosen from the luminance histogram
+    int numThreads;
+    bool useMmap;       // --mmap: map SRC and TARGET instead of streaming through fstream
+    bool usePread;      // --pread: every pool worker pread()s and decodes its own band of rows
+    bool fused;         // --fused: decode + luminance and mapping in one pass per row band
+    KernelISA kernelISA; // --kernel: force the scalar, SSE4.1 or AVX2 Reinhard kernel
+    bool useLUT;        // --lut: integer lookup-table path on the raw 8-bit pixels
+    int tileRows;       // --tile-rows: rows per work item handed to the thread pool
+    bool tileStats;     // --tile-stats: print the per-tile timing histogram
+    bool pinThreads;    // --pin: pin pool worker i to CPU i
+    size_t streamBytes; // --stream MB: two-pass strip mode within this memory budget, 0 = off
+    ToneOperator toneOperator; // --operator global|extended|local
+    TransferFunction transfer; // --srgb: linearize the input bytes and sRGB-encode the output
+    bool deterministic; // --deterministic: fixed-point log average and exact kernels, same bits for any thread count
+    float whitePoint;   // --white: scaled luminance mapped to white by the extended curve, 0 = image maximum
+    std::vector<std::string> sweepKeys; // --sweep: exposure keys mapped from one decode, as typed
+    bool statsCache;    // --stats-cache: reuse log averages from "<src>.lum" sidecars
+    LuminanceCacheEntry* luminanceCache; // set by toneMapFile() for the file being mapped
+    StatsFormat stats;  // --stats text|json: per-stage timing report
+};
+
+// Maps count pixels to 8-bit output, see reinhardKernels.cpp.
+typedef void (*ReinhardKernel)(const float* r, const float* g, const float* b, RGB* output,
+                               size_t count, float avgLum, float exposureKey);
+
+// Pixel layouts the reader converts from, see bmpFormat.cpp.
+enum BMPLayout {
+    LAYOUT_BGR24,       // 24-bit BI_RGB
+    LAYOUT_BGRX32,      // 32-bit BI_RGB, or BI_BITFIELDS with the usual BGRA masks
+    LAYOUT_MASKED32     // 32-bit BI_BITFIELDS with any other masks
+};
+
+// Input pixel format and geometry of a BMP file, filled in by bmpFormat().
+struct BMPFormat {
+    BMPLayout layout;
+    int width;
+    int height;         // always positive
+    bool topDown;       // negative height in the header, first row in the file is the top one
+    int bytesPerPixel;
+    size_t srcStride;   // bytes per row in the file
+    uint32_t masks[3];  // r, g, b
+    int shifts[3];
+    uint32_t maxValues[3];
+
+    // 24-bit bottom-up: the file rows can be used as they are.
+    bool canonical() const { return layout == LAYOUT_BGR24 && !topDown; }
+};
+
+// A file mapped with mmap(), see mapFileRead() / mapFileWrite().
+struct MappedFile {
+    int fd;
+    uint8_t* data;
+    size_t size;
+};
+
+// Rec. 709 luminance weights and the log() offset that keeps black pixels finite.
+const RGBf LUMINANCE_WEIGHTS = {0.2126f, 0.7152f, 0.0722f};
+const float LUMINANCE_DELTA = 1e-4f;
+
+inline float pixelLuminance(const RGBf& pixel){
+    return LUMINANCE_WEIGHTS.b * pixel.b + LUMINANCE_WEIGHTS.g * pixel.g + LUMINANCE_WEIGHTS.r * pixel.r;
+}
+
+// Auto-exposure histogram of delta + L: 1/16 stop bins from 2^-32 to 2^32 (see toneExposure.cpp).
+const int EXPOSURE_MIN_STOP = -32;
+const int EXPOSURE_BINS_PER_STOP = 16;
+const int EXPOSURE_HISTOGRAM_BINS = 64 * EXPOSURE_BINS_PER_STOP;
+
+// The bin is read straight off the float's exponent and top four mantissa bits, a piecewise-linear
+// log2 that costs no more than a shift. luminance must be positive.
+inline int exposureBin(float luminance){
+    uint32_t bits;
+    memcpy(&bits, &luminance, sizeof(bits));
+    int bin = (int)(bits >> 19) - ((127 + EXPOSURE_MIN_STOP) << 4);
+    return std::min(EXPOSURE_HISTOGRAM_BINS - 1, std::max(0, bin));
+}
+
+// Allocator whose resize() leaves new elements uninitialized instead of zeroing them on the
+// calling thread. The pages of a big buffer are then first touched by the pool worker that fills
+// its rows, which puts them on that worker's NUMA node. Only for types that need no construction.
+template <typename T>
+struct FirstTouchAllocator : std::allocator<T> {
+    template <typename U> struct rebind { typedef FirstTouchAllocator<U> other; };
+
+    FirstTouchAllocator() = default;
+    template <typename U> FirstTouchAllocator(const FirstTouchAllocator<U>&) {}
+
+    template <typename U> void construct(U* p){ ::new(static_cast<void*>(p)) U; }
+    template <typename U, typename... Args> void construct(U* p, Args&&... args){
+        ::new(static_cast<void*>(p)) U(std::forward<Args>(args)...);
+    }
+};
+
+// Mapped 8-bit pixels, filled tile by tile by the pool.
+typedef std::vector<RGB, FirstTouchAllocator<RGB>> RGBBuffer;
+
+// A padded BGR pixel array as written to a BMP file. Not zeroed on resize either; the encoder fills
+// every byte, padding included, on the worker that owns the row.
+typedef std::vector<uint8_t, FirstTouchAllocator<uint8_t>> BMPPixelArray;
+
+// Every plane starts on a cache line boundary.
+const size_t PLANE_ALIGNMENT = 64;
+
+// Planar float image used between decode and encode: separate R, G and B planes
+// instead of interleaved RGBf, so the luminance pass and the kernels can use plain vector loads.
+// Interleaved BGR only exists in the file buffers.
+class PlanarImage {
+public:
+    PlanarImage();
+    PlanarImage(size_t width, size_t height);
+    ~PlanarImage();
+    PlanarImage(const PlanarImage&) = delete;
+    PlanarImage& operator=(const PlanarImage&) = delete;
+
+    // With a pool, new planes are first touched band by band by the workers (see firstTouchRows()).
+    void resize(size_t width, size_t height, ThreadPool* pool = nullptr);
+    bool tryResize(size_t width, size_t height, ThreadPool* pool = nullptr);
+    size_t size() const { return width * height; }
+
+    float* r;
+    float* g;
+    float* b;
+    size_t width;
+    size_t height;
+
+private:
+    float* buffer;
+    size_t capacity;
+};
+
+// Each BMP row is padded to a multiple of 4 bytes.
+inline size_t bmpRowStride(int width){
+    return ((size_t)width * 3 + 3) & ~(size_t)3;
+}
+
+void readBMPHeaders(std::istream& readBMP, BMPFileHeader& bmpFile, BMPInfoHeader& bmpInfo);
+void decodeBMPPixels(std::istream& readBMP, const BMPFileHeader& bmpFile, const BMPFormat& format, PlanarImage& output,
+                     ThreadPool* pool = nullptr);
+void preadBMPPixels(const char* path, const BMPFileHeader& bmpFile, const BMPFormat& format, PlanarImage& output,
+                    ThreadPool& pool);
+void firstTouchRows(void* data, size_t rowBytes, int height, ThreadPool& pool);
+void readBMPPixelArray(std::istream& readBMP, const BMPFileHeader& bmpFile, const BMPFormat& format, std::vector<uint8_t>& rawPixels);
+void benchDecode(int argc, char *argv[]);
+void writeBMPPixelArray(std::ostream& writeBMP, const BMPFileHeader& bmpFile, const BMPInfoHeader& bmpInfo,
+                        const BMPPixelArray& pixelArray);
+void encodeBMPRows(int startRow, int endRow, int width, const RGB* pixels, uint8_t* dst, size_t dstStride);
+void encodeBMPPixelArray(const RGBBuffer& pixels, int width, int height, BMPPixelArray& pixelArray,
+                         ThreadPool& pool);
+void makeBMPHeaders(int width, int height, BMPFileHeader& bmpFile, BMPInfoHeader& bmpInfo);
+void writeBMPImage(const char* path, const RGBBuffer& pixels, int width, int height, ThreadPool& pool);
+void benchKernel(int argc, char *argv[]);
+void benchLUT(int argc, char *argv[]);
+void benchScaling(int argc, char *argv[]);
+void writeSyntheticBMP(const char* path, int width, int height, float stops);
+void parseBMPHeaders(const uint8_t* data, BMPFileHeader& bmpFile, BMPInfoHeader& bmpInfo);
+void serializeBMPHeaders(uint8_t* data, const BMPFileHeader& bmpFile, const BMPInfoHeader& bmpInfo);
+
+BMPFormat bmpFormat(const BMPInfoHeader& bmpInfo, const uint8_t* maskBytes);
+BMPFormat readBMPFormat(std::istream& readBMP, const BMPInfoHeader& bmpInfo);
+BMPInfoHeader outputInfoHeader(const BMPInfoHeader& bmpInfo);
+void convertBMPRows(const BMPFormat& format, const uint8_t* src, int rows, uint8_t* dst, size_t dstStride);
+void decodeBMPRows(const BMPFormat& format, const uint8_t* src, int rows, PlanarImage& output, int firstRow);
+int firstFileRow(const BMPFormat& format, int startRow, int endRow);
+
+MappedFile mapFileRead(const char* path);
+MappedFile mapFileWrite(const char* path, size_t size);
+void unmapFile(MappedFile& file);
+
+void luminanceChunk(size_t startIdx, size_t endIdx, const PlanarImage& input, double& partialSum,
+                    uint32_t* exposureHistogram = nullptr);
+void luminanceRows(int startRow, int endRow, int width, const uint8_t* src, size_t srcStride, double& partialSum,
+                   uint32_t* exposureHistogram = nullptr);
+float logAverageLuminance(const PlanarImage& pixels, ThreadPool& pool, std::vector<uint64_t>* exposureHistogram = nullptr);
+float logAverageLuminanceRows(const uint8_t* src, int width, int height, size_t srcStride, ThreadPool& pool,
+                              std::vector<uint64_t>* exposureHistogram = nullptr);
+
+void decodeRows(int startRow, int endRow, int width, const uint8_t* src, size_t srcStride,
+                PlanarImage& output, double& partialSum);
+float toneMapFused(const uint8_t* rawPixels, size_t srcStride, int width, int height,
+                   RGBBuffer& outputPixels, float exposureKey, ThreadPool& pool);
+void printTileTimings(const TileTimings& timings);
+
 RGBf toneMapReinhard(RGBf color, float avgLum, float a);
-void processChunk(int startIdx, int endIdx, const std::vector<RGBf>& input, std::vector<RGB>& output, float avgLum, float exposureKey);
-void argCheck(int argc, char *argv[]);
-void toneMap(int argc, char *argv[]);
+RGB toOutputPixel(RGBf mappedPixel);
+void processChunk(size_t startIdx, size_t endIdx, const PlanarImage& input, RGBBuffer& output, float avgLum, float exposureKey);
+void processRows(int startRow, int endRow, int width, const uint8_t* src, size_t srcStride,
+                 uint8_t* dst, size_t dstStride, float avgLum, float exposureKey);
+void reinhardScalar(const float* r, const float* g, const float* b, RGB* output, size_t count, float avgLum, float exposureKey);
+void reinhardSSE41(const float* r, const float* g, const float* b, RGB* output, size_t count, float avgLum, float exposureKey);
+void reinhardAVX2(const float* r, const float* g, const float* b, RGB* output, size_t count, float avgLum, float exposureKey);
+bool kernelISASupported(KernelISA isa);
+KernelISA detectKernelISA();
+const char* kernelISAName(KernelISA isa);
+ReinhardKernel reinhardKernelFor(KernelISA isa);
+void selectReinhardKernel(KernelISA isa);
+ReinhardKernel selectedReinhardKernel();
+void reinhardExactScalar(const float* r, const float* g, const float* b, RGB* output, size_t count, float avgLum, float exposureKey);
+void reinhardExactSSE41(const float* r, const float* g, const float* b, RGB* output, size_t count, float avgLum, float exposureKey);
+void reinhardExactAVX2(const float* r, const float* g, const float* b, RGB* output, size_t count, float avgLum, float exposureKey);
+
+void selectDeterministicMode(bool enabled);
+bool deterministicMode();
+void fixedLuminanceChunk(size_t startIdx, size_t endIdx, const PlanarImage& input, double& partialSum,
+                         uint32_t* exposureHistogram);
+void fixedLuminanceRows(int startRow, int endRow, int width, const uint8_t* src, size_t srcStride,
+                        double& partialSum, uint32_t* exposureHistogram);
+float logAverageFromSum(double logSum, size_t totalPixels);
+
+const float* normalizationLUT();
+
+void selectTransferFunction(TransferFunction transfer);
+TransferFunction selectedTransferFunction();
+double srgbToLinear(double value);
+double linearToSRGB(double value);
+const float* srgbDecodeLUT();
+const int32_t* outputEncodeLUT();
+RGB toSRGBOutputPixel(RGBf mappedPixel, const int32_t* encode);
+
+// Output byte of a linear value through the encode table (NaN and negative values give entry 0).
+inline uint8_t encodeSRGB(float value, const int32_t* encode){
+    float index = std::min((float)(SRGB_ENCODE_SIZE - 1), std::max(0.0f, value * (SRGB_ENCODE_SIZE - 1)));
+    return (uint8_t)encode[(int)index];
+}
+
+// Deterministic mode's Reinhard mapping of one pixel: min(c * scaleMax / (1 + sL), maxOutput) with
+// scaleMax = s * maxOutput, truncated. The exact kernels do the same float operations in the same
+// order, so every path produces the same bytes (see reinhardKernels.cpp).
+inline RGB toneMapExact(RGBf pixel, float scale, float scaleMax, float maxOutput, const int32_t* encode){
+    float L = LUMINANCE_WEIGHTS.r * pixel.r + LUMINANCE_WEIGHTS.g * pixel.g + LUMINANCE_WEIGHTS.b * pixel.b;
+    float factor = L >= 1e-5f ? scaleMax / (1.0f + scale * L) : 0.0f;
+    int32_t r = (int32_t)std::min(pixel.r * factor, maxOutput);
+    int32_t g = (int32_t)std::min(pixel.g * factor, maxOutput);
+    int32_t b = (int32_t)std::min(pixel.b * factor, maxOutput);
+    if(encode)
+        return {(uint8_t)encode[r], (uint8_t)encode[g], (uint8_t)encode[b]};
+    return {(uint8_t)r, (uint8_t)g, (uint8_t)b};
+}
+
+void luminanceHistogramRows(int startRow, int endRow, int width, const uint8_t* src, size_t srcStride,
+                            std::vector<uint32_t>& histogram);
+float logAverageFromHistogram(const std::vector<uint64_t>& histogram, size_t totalPixels);
+float logAverageLuminanceLUT(const uint8_t* src, int width, int height, size_t srcStride, ThreadPool& pool,
+                             std::vector<uint64_t>* histogramOut = nullptr);
+float autoExposureKeyLUT(float logAverage, const std::vector<uint64_t>& histogram);
+void buildReinhardLUT(float avgLum, float exposureKey, std::vector<uint32_t>& table);
+void lutMapRows(int startRow, int endRow, int width, const uint8_t* src, size_t srcStride,
+                uint8_t* dst, size_t dstStride, const uint32_t* table);
+float toneMapLUT(const uint8_t* src, size_t srcStride, uint8_t* dst, size_t dstStride, int width, int height,
+                 float exposureKey, ThreadPool& pool, LuminanceCacheEntry* luminanceCache = nullptr);
+
+void toneMapExtended(const PlanarImage& input, RGBBuffer& output, float avgLum, float exposureKey,
+                     float whitePoint, ThreadPool& pool);
+void toneMapLocal(const PlanarImage& input, RGBBuffer& output, float avgLum, float exposureKey,
+                  ThreadPool& pool);
+void toneMapPlanar(const ToneOptions& options, const PlanarImage& input, float avgLum, RGBBuffer& output,
+                   ThreadPool& pool);
+
+ToneOptions argCheck(int argc, char *argv[]);
+void toneMap(const ToneOptions& options, ThreadPool& pool);
+float toneMapFile(const ToneOptions& options, ThreadPool& pool);
+float toneMapStream(const ToneOptions& options, ThreadPool& pool);
+float toneMapMmap(const ToneOptions& options, ThreadPool& pool);
+float toneMapStrips(const ToneOptions& options, ThreadPool& pool);
+bool isHDRPath(const char* path);
+void readPFM(const char* path, PlanarImage& output, ThreadPool& pool);
+void readRGBE(const char* path, PlanarImage& output, ThreadPool& pool);
+void readHDR(const char* path, PlanarImage& output, ThreadPool& pool);
+float toneMapHDR(const ToneOptions& options, ThreadPool& pool);
+void toneMapBatch(const ToneOptions& options, ThreadPool& pool);
+std::vector<std::string> collectSources(const std::string& src);
+std::vector<std::string> batchTargets(const std::vector<std::string>& sources, const std::string& targetDir);
+void toneMapSequence(const ToneOptions& options, ThreadPool& pool);
+void toneMapSweep(const ToneOptions& options, ThreadPool& pool);
+
+void loadLuminanceCache(const char* srcPath, LuminanceCacheEntry& entry);
+float cachedLogAverage(LuminanceCacheEntry* entry, LuminanceSlot slot, const std::function<float()>& compute,
+                       float* autoKey = nullptr);
+void storeLuminanceCache(const char* srcPath, const LuminanceCacheEntry& entry);
+void printLuminanceCacheStats();
+
+float autoExposureKey(float logAverage, const std::vector<uint64_t>& histogram);
+float autoExposureKeyBins(float logAverage, const std::vector<uint64_t>& histogram,
+                          const std::function<double(size_t bin)>& binLuminance);
+void mergeExposureHistograms(const std::vector<std::vector<uint32_t>>& workerHistograms,
+                             std::vector<uint64_t>& histogram);
+float planarLogAverage(const ToneOptions& options, const PlanarImage& pixels, ThreadPool& pool, float& exposureKey);
+
+void enableToneStats();
+void printToneStats(StatsFormat format, int threads);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,192 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+#include "tone.h"
+#include "threadPool.h"
+
+// Batch mode: one process and one thread pool for a whole directory (or manifest) of images.
+//
+// Images too small to keep every worker busy (fewer than two tiles per worker) are spread over
+// the pool one image per task, each mapped serially through a 0-thread pool. Big images are mapped
+// one after another with the whole pool, and the next big file is handed to the kernel read-ahead
+// before the current one starts so its read overlaps the mapping.
+
+namespace fs = std::filesystem;
+
+struct BatchJob {
+    std::string srcPath;
+    std::string targetPath;
+    int height;
+};
+
+static bool isInputImage(const fs::path& path){
+    return path.extension() == ".bmp" || isHDRPath(path.c_str());
+}
+
+// Every *.bmp, *.pfm and *.hdr in a directory (sorted, so output order is stable) or one path per line of a manifest.
+std::vector<std::string> collectSources(const std::string& src){
+    std::vector<std::string> sources;
+
+    if(fs::is_directory(src)){
+        for(const auto& entry : fs::directory_iterator(src)){
+            if(entry.is_regular_file() && isInputImage(entry.path()))
+                sources.push_back(entry.path().string());
+        }
+        std::sort(sources.begin(), sources.end());
+        return sources;
+    }
+
+    std::ifstream manifest(src);
+    if(!manifest){
+        std::cerr << "Error: Could not open " << src << std::endl;
+        exit(1);
+    }
+
+    std::string line;
+    while(std::getline(manifest, line)){
+        if(!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if(line.empty() || line[0] == '#')
+            continue;
+        if(!isInputImage(line)){
+            std::cerr << "Error: " << line << " is not a bmp, pfm or hdr file." << std::endl;
+            exit(1);
+        }
+        sources.push_back(line);
+    }
+    return sources;
+}
+
+// TARGET/<basename>.bmp for every source. Exits if a target would overwrite its source, or if two
+// sources (a/x.bmp and b/x.bmp, x.bmp and x.hdr) share a target, which the workers would race on.
+std::vector<std::string> batchTargets(const std::vector<std::string>& sources, const std::string& targetDir){
+    std::vector<std::string> targets;
+    std::map<std::string, std::string> sourceOf;
+
+    for(const auto& source : sources){
+        std::string target = (fs::path(targetDir) / fs::path(source).filename().replace_extension(".bmp")).string();
+
+        if(fs::exists(target) && fs::equivalent(source, target)){
+            std::cerr << "Error: " << target << " would overwrite its source." << std::endl;
+            exit(1);
+        }
+
+        auto inserted = sourceOf.insert({target, source});
+        if(!inserted.second){
+            std::cerr << "Error: " << inserted.first->second << " and " << source << " would both be written to "
+                      << target << "." << std::endl;
+            exit(1);
+        }
+        targets.push_back(target);
+    }
+    return targets;
+}
+
+static int readBMPHeight(const std::string& path){
+    std::ifstream readBMP(path, std::ios::binary);
+    if(!readBMP){
+        std::cerr << "Error: Could not open " << path << std::endl;
+        exit(1);
+    }
+
+    BMPFileHeader bmpFile;
+    BMPInfoHeader bmpInfo;
+    readBMPHeaders(readBMP, bmpFile, bmpInfo);
+    return std::abs(bmpInfo.height);
+}
+
+// Asks the kernel to start reading path into the page cache, returns immediately.
+static void prefetchFile(const std::string& path){
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0)
+        return;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+}
+
+void toneMapBatch(const ToneOptions& options, ThreadPool& pool){
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::string> sources = collectSources(options.srcPath);
+    if(sources.empty()){
+        std::cerr << "Error: No bmp, pfm or hdr files found in " << options.srcPath << std::endl;
+        exit(1);
+    }
+
+    fs::path targetDir(options.targetPath);
+    std::error_code ec;
+    fs::create_directories(targetDir, ec);
+    if(!fs::is_directory(targetDir)){
+        std::cerr << "Error: Could not create directory " << options.targetPath << std::endl;
+        exit(1);
+    }
+
+    std::vector<std::string> targets = batchTargets(sources, options.targetPath);
+    std::vector<BatchJob> smallJobs;
+    std::vector<BatchJob> bigJobs;
+    int smallLimit = 2 * pool.size();
+
+    for(size_t i = 0; i < sources.size(); i++){
+        BatchJob job;
+        job.srcPath = sources[i];
+        job.targetPath = targets[i];
+        // HDR headers are not parsed up front, those files always count as big.
+        job.height = isHDRPath(job.srcPath.c_str()) ? -1 : readBMPHeight(job.srcPath);
+
+        if(job.height >= 0 && pool.tileCount(job.height) < smallLimit)
+            smallJobs.push_back(job);
+        else
+            bigJobs.push_back(job);
+    }
+
+    std::mutex printMutex;
+    auto report = [&](const BatchJob& job, float logAvgLuminance){
+        std::lock_guard<std::mutex> lock(printMutex);
+        std::cout << job.srcPath << " -> " << job.targetPath << " (" << logAvgLuminance << ")" << std::endl;
+    };
+
+    // Inter-image parallelism: one serial pool per worker, every small image is one task.
+    if(!smallJobs.empty()){
+        std::vector<std::unique_ptr<ThreadPool>> serialPools;
+        for(int i = 0; i < pool.size(); i++){
+            serialPools.push_back(std::unique_ptr<ThreadPool>(new ThreadPool(0, options.tileRows)));
+        }
+
+        pool.parallelFor((int)smallJobs.size(), [&](int index, int worker){
+            ToneOptions imageOptions = options;
+            imageOptions.batch = false;
+            imageOptions.srcPath = smallJobs[index].srcPath.c_str();
+            imageOptions.targetPath = smallJobs[index].targetPath.c_str();
+
+            report(smallJobs[index], toneMapFile(imageOptions, *serialPools[worker]));
+        });
+    }
+
+    // Intra-image parallelism for the big ones, reading the next file ahead.
+    if(!bigJobs.empty())
+        prefetchFile(bigJobs[0].srcPath);
+
+    for(size_t i = 0; i < bigJobs.size(); i++){
+        if(i + 1 < bigJobs.size())
+            prefetchFile(bigJobs[i + 1].srcPath);
+
+        ToneOptions imageOptions = options;
+        imageOptions.batch = false;
+        imageOptions.srcPath = bigJobs[i].srcPath.c_str();
+        imageOptions.targetPath = bigJobs[i].targetPath.c_str();
+
+        report(bigJobs[i], toneMapFile(imageOptions, pool));
+    }
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << sources.size() << " images (" << smallJobs.size() << " small, " << bigJobs.size()
+              << " big) tone mapped in " << elapsed.count() << " s." << std::endl;
+}
@@ -0,0 +1,258 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <cstring>
+#include <cstdio>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include "tone.h"
+#include "threadPool.h"
+
+// Scaling benchmark (--bench-scaling). Writes a synthetic 24-bit BMP for every requested size, then
+// times the four stages of the default pipeline -- decode, luminance reduction, mapping and
+// encode (including the write) -- separately with 1, 2, 4, ... up to the maximum thread count.
+// Each stage reports its best time over the iterations. Results go to stdout as CSV or JSON, one
+// record per size and thread count, with speedup and efficiency against the 1-thread run.
+//
+// The source file is read back from the page cache, so decode measures parsing, not the disk.
+
+static const char* BENCH_SOURCE_PATH = "tone_bench_src.bmp";
+static const char* BENCH_TARGET_PATH = "tone_bench_out.bmp";
+
+struct ScalingResult {
+    double megapixels;
+    int width;
+    int height;
+    int threads;
+    double decodeSeconds;
+    double luminanceSeconds;
+    double mapSeconds;
+    double encodeSeconds;
+
+    double totalSeconds() const { return decodeSeconds + luminanceSeconds + mapSeconds + encodeSeconds; }
+};
+
+// 4:3 image with about megapixels million pixels.
+static void syntheticSize(double megapixels, int& width, int& height){
+    double pixels = megapixels * 1000000.0;
+    width = std::max(1, (int)std::lround(std::sqrt(pixels * 4.0 / 3.0)));
+    height = std::max(1, (int)std::lround(pixels / width));
+}
+
+// Writes a width x height 24-bit BMP whose luminance spans about stops f-stops (at most 8, the
+// range of 8-bit samples): a horizontal ramp times a vertical wave, with a colour tint that
+// changes across the image and a little LCG noise. Luminance is separable, so each row costs
+// one multiply per channel. Rows are generated one at a time, so any size fits in memory.
+void writeSyntheticBMP(const char* path, int width, int height, float stops){
+    std::ofstream writeBMP(path, std::ios::binary);
+    if(!writeBMP){
+        std::cerr << "Error: Cannot open file " << path << std::endl;
+        exit(1);
+    }
+
+    size_t rowStride = bmpRowStride(width);
+    BMPFileHeader bmpFile;
+    BMPInfoHeader bmpInfo;
+    makeBMPHeaders(width, height, bmpFile, bmpInfo);
+    bmpFile.dataOffset = BMP_HEADER_SIZE;
+    bmpFile.fileSize = BMP_HEADER_SIZE + rowStride * height;
+
+    uint8_t headers[BMP_HEADER_SIZE];
+    serializeBMPHeaders(headers, bmpFile, bmpInfo);
+    writeBMP.write(reinterpret_cast<const char*>(headers), BMP_HEADER_SIZE);
+
+    // Per column: half the stops as a ramp, and the tint.
+    std::vector<float> columnR(width), columnG(width), columnB(width);
+    for(int x = 0; x < width; x++){
+        float t = width > 1 ? (float)x / (width - 1) : 0.0f;
+        float level = 255.0f * std::exp2(-0.5f * stops * t);
+        columnR[x] = level * (0.85f + 0.15f * std::cos(6.2831853f * t));
+        columnG[x] = level * (0.85f + 0.15f * std::cos(6.2831853f * (t + 0.33f)));
+        columnB[x] = level * (0.85f + 0.15f * std::cos(6.2831853f * (t + 0.67f)));
+    }
+
+    std::vector<uint8_t> row(rowStride, 0);
+    uint32_t seed = 12345;
+
+    for(int y = 0; y < height; y++){
+        // Per row: the other half of the stops as six periods of a wave.
+        float wave = 0.5f + 0.5f * std::sin(6.2831853f * 6.0f * y / height);
+        float rowLevel = std::exp2(-0.5f * stops * wave);
+
+        for(int x = 0; x < width; x++){
+            seed = seed * 1664525u + 1013904223u;
+            float noise = 0.97f + 0.06f * (seed >> 24) / 255.0f;
+            float level = rowLevel * noise;
+            row[x * 3 + 0] = (uint8_t)std::min(columnB[x] * level, 255.0f);
+            row[x * 3 + 1] = (uint8_t)std::min(columnG[x] * level, 255.0f);
+            row[x * 3 + 2] = (uint8_t)std::min(columnR[x] * level, 255.0f);
+        }
+        writeBMP.write(reinterpret_cast<const char*>(row.data()), rowStride);
+    }
+
+    if(!writeBMP){
+        std::cerr << "Error: Cannot write output file" << std::endl;
+        exit(1);
+    }
+}
+
+static double secondsSince(std::chrono::steady_clock::time_point start){
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+// Best time of every stage over iterations runs of the default pipeline on threads workers.
+static ScalingResult benchPipeline(int threads, int iterations){
+    ThreadPool pool(threads);
+
+    ToneOptions options = ToneOptions();
+    options.exposureKey = 0.18f;
+    options.toneOperator = OPERATOR_GLOBAL;
+
+    ScalingResult result;
+    result.threads = threads;
+    result.decodeSeconds = result.luminanceSeconds = result.mapSeconds = result.encodeSeconds = 1e30;
+
+    PlanarImage pixels;
+    RGBBuffer outputPixels;
+
+    for(int i = 0; i < iterations; i++){
+        auto start = std::chrono::steady_clock::now();
+        std::ifstream readBMP(BENCH_SOURCE_PATH, std::ios::binary);
+        if(!readBMP){
+            std::cerr << "Error: Cannot open file " << BENCH_SOURCE_PATH << std::endl;
+            exit(1);
+        }
+        BMPFileHeader bmpFile;
+        BMPInfoHeader bmpInfo;
+        readBMPHeaders(readBMP, bmpFile, bmpInfo);
+        BMPFormat format = readBMPFormat(readBMP, bmpInfo);
+        decodeBMPPixels(readBMP, bmpFile, format, pixels, &pool);
+        result.decodeSeconds = std::min(result.decodeSeconds, secondsSince(start));
+
+        start = std::chrono::steady_clock::now();
+        float logAvgLuminance = logAverageLuminance(pixels, pool);
+        result.luminanceSeconds = std::min(result.luminanceSeconds, secondsSince(start));
+
+        start = std::chrono::steady_clock::now();
+        toneMapPlanar(options, pixels, logAvgLuminance, outputPixels, pool);
+        result.mapSeconds = std::min(result.mapSeconds, secondsSince(start));
+
+        start = std::chrono::steady_clock::now();
+        writeBMPImage(BENCH_TARGET_PATH, outputPixels, pixels.width, pixels.height, pool);
+        result.encodeSeconds = std::min(result.encodeSeconds, secondsSince(start));
+    }
+
+    return result;
+}
+
+// "1,16,64" -> {1, 16, 64}; exits on anything that is not a positive number.
+static std::vector<double> parseMegapixels(const char* arg){
+    std::vector<double> sizes;
+    std::stringstream list(arg);
+    std::string item;
+
+    while(std::getline(list, item, ',')){
+        char* end;
+        double megapixels = std::strtod(item.c_str(), &end);
+        if(item.empty() || *end != '\0' || !(megapixels > 0.0)){
+            std::cout << item << " is not a valid size in megapixels." << std::endl;
+            exit(1);
+        }
+        sizes.push_back(megapixels);
+    }
+    return sizes;
+}
+
+// 1, 2, 4, ... below maxThreads, then maxThreads itself.
+static std::vector<int> threadCounts(int maxThreads){
+    std::vector<int> counts;
+    for(int threads = 1; threads < maxThreads; threads *= 2){
+        counts.push_back(threads);
+    }
+    counts.push_back(maxThreads);
+    return counts;
+}
+
+static void printResult(const ScalingResult& result, const ScalingResult& serial, float stops, bool json, bool last){
+    double speedup = serial.totalSeconds() / result.totalSeconds();
+    double efficiency = speedup / result.threads;
+    char line[512];
+
+    if(json){
+        snprintf(line, sizeof(line),
+                 "  {\"megapixels\": %g, \"width\": %d, \"height\": %d, \"stops\": %g, \"threads\": %d, "
+                 "\"decode_s\": %.6f, \"luminance_s\": %.6f, \"map_s\": %.6f, \"encode_s\": %.6f, "
+                 "\"total_s\": %.6f, \"speedup\": %.3f, \"efficiency\": %.3f}%s",
+                 result.megapixels, result.width, result.height, stops, result.threads, result.decodeSeconds,
+                 result.luminanceSeconds, result.mapSeconds, result.encodeSeconds, result.totalSeconds(),
+                 speedup, efficiency, last ? "" : ",");
+    }
+    else {
+        snprintf(line, sizeof(line), "%g,%d,%d,%g,%d,%.6f,%.6f,%.6f,%.6f,%.6f,%.3f,%.3f",
+                 result.megapixels, result.width, result.height, stops, result.threads, result.decodeSeconds,
+                 result.luminanceSeconds, result.mapSeconds, result.encodeSeconds, result.totalSeconds(),
+                 speedup, efficiency);
+    }
+    std::cout << line << std::endl;
+}
+
+// ./tone --bench-scaling [megapixels,...] [stops] [max threads] [iterations] [--json]
+void benchScaling(int argc, char *argv[]){
+    bool json = argc >= 3 && strcmp(argv[argc - 1], "--json") == 0;
+    int positional = json ? argc - 1 : argc;
+    if(positional > 6){
+        std::cout << "./tone --bench-scaling [megapixels,...] [stops] [max threads] [iterations] [--json]" << std::endl;
+        exit(1);
+    }
+
+    std::vector<double> sizes = parseMegapixels(positional >= 3 ? argv[2] : "1,16");
+    float stops = positional >= 4 ? std::atof(argv[3]) : 8.0f;
+    int maxThreads = positional >= 5 ? std::atoi(argv[4]) : (int)std::max(1u, std::thread::hardware_concurrency());
+    int iterations = positional >= 6 ? std::atoi(argv[5]) : 3;
+
+    if(!(stops >= 0.0f && stops <= 8.0f)){
+        std::cout << "[stops] must be between 0 and 8 (8-bit samples)." << std::endl;
+        exit(1);
+    }
+    if(maxThreads <= 0 || iterations <= 0){
+        std::cout << "[max threads] and [iterations] must be positive." << std::endl;
+        exit(1);
+    }
+
+    std::vector<int> counts = threadCounts(maxThreads);
+
+    if(json)
+        std::cout << "[" << std::endl;
+    else
+        std::cout << "megapixels,width,height,stops,threads,decode_s,luminance_s,map_s,encode_s,total_s,speedup,efficiency"
+                  << std::endl;
+
+    for(size_t s = 0; s < sizes.size(); s++){
+        int width, height;
+        syntheticSize(sizes[s], width, height);
+        writeSyntheticBMP(BENCH_SOURCE_PATH, width, height, stops);
+
+        ScalingResult serial = ScalingResult();
+        for(size_t c = 0; c < counts.size(); c++){
+            ScalingResult result = benchPipeline(counts[c], iterations);
+            result.megapixels = sizes[s];
+            result.width = width;
+            result.height = height;
+            if(c == 0)
+                serial = result;
+
+            printResult(result, serial, stops, json, s + 1 == sizes.size() && c + 1 == counts.size());
+        }
+    }
+
+    if(json)
+        std::cout << "]" << std::endl;
+
+    std::remove(BENCH_SOURCE_PATH);
+    std::remove(BENCH_TARGET_PATH);
+}
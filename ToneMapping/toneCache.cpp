@@ -0,0 +1,142 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <functional>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+#include <sys/stat.h>
+#include "tone.h"
+
+// Luminance statistics cache (--stats-cache). The log-average luminance of a source image is kept in
+// a sidecar file next to it, "<src>.lum", so a later run on the same file skips the luminance pre-pass.
+// Entries are keyed by file size, modification time and a hash of the first and last
+// LUMINANCE_CACHE_SAMPLE bytes; any mismatch counts as a miss and the sidecar is rewritten.
+//
+// The float paths and the LUT path compute slightly different averages, so each has its own slot.
+// A slot also keeps the automatic key chosen from its luminance histogram, so "auto" runs skip the
+// pass too; the histogram itself is not stored.
+
+static const char LUMINANCE_CACHE_MAGIC[4] = {'T', 'L', 'U', 'M'};
+static const uint32_t LUMINANCE_CACHE_VERSION = 2;
+static const size_t LUMINANCE_CACHE_SAMPLE = 64 * 1024;
+
+static std::atomic<int> cacheHits(0);
+static std::atomic<int> cacheMisses(0);
+static std::atomic<int64_t> savedMicros(0);
+
+static uint64_t fnv1a(const uint8_t* data, size_t size, uint64_t hash){
+    for(size_t i = 0; i < size; i++){
+        hash = (hash ^ data[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static std::string sidecarPath(const char* srcPath){
+    return std::string(srcPath) + ".lum";
+}
+
+// Fills in the key fields of record for the file as it is now. Returns false if it cannot be read.
+static bool fileKey(const char* srcPath, LuminanceCacheRecord& record){
+    struct stat info;
+    if(stat(srcPath, &info) != 0)
+        return false;
+
+    std::ifstream file(srcPath, std::ios::binary);
+    if(!file)
+        return false;
+
+    std::vector<uint8_t> sample(LUMINANCE_CACHE_SAMPLE);
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    file.read(reinterpret_cast<char*>(sample.data()), sample.size());
+    hash = fnv1a(sample.data(), file.gcount(), hash);
+
+    if((uint64_t)info.st_size > LUMINANCE_CACHE_SAMPLE){
+        file.clear();
+        file.seekg(-(std::streamoff)std::min<uint64_t>(LUMINANCE_CACHE_SAMPLE, info.st_size - LUMINANCE_CACHE_SAMPLE),
+                   std::ios::end);
+        file.read(reinterpret_cast<char*>(sample.data()), sample.size());
+        hash = fnv1a(sample.data(), file.gcount(), hash);
+    }
+
+    memcpy(record.magic, LUMINANCE_CACHE_MAGIC, 4);
+    record.version = LUMINANCE_CACHE_VERSION;
+    record.fileSize = info.st_size;
+    record.mtimeNs = (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+    record.sampleHash = hash;
+    return true;
+}
+
+void loadLuminanceCache(const char* srcPath, LuminanceCacheEntry& entry){
+    entry.keyed = false;
+    entry.dirty = false;
+
+    LuminanceCacheRecord current;
+    memset(&current, 0, sizeof(current));
+    if(!fileKey(srcPath, current))
+        return;
+    entry.keyed = true;
+
+    LuminanceCacheRecord stored;
+    std::ifstream sidecar(sidecarPath(srcPath), std::ios::binary);
+    sidecar.read(reinterpret_cast<char*>(&stored), sizeof(stored));
+
+    bool matches = sidecar && memcmp(stored.magic, current.magic, 4) == 0 && stored.version == current.version
+                   && stored.fileSize == current.fileSize && stored.mtimeNs == current.mtimeNs
+                   && stored.sampleHash == current.sampleHash;
+    if(!matches)
+        stored = current;
+
+    entry.record = stored;
+}
+
+// With autoKey the caller wants the automatic key as well: compute() must also set *autoKey, and a
+// hit needs the slot's cached key, which it stores in *autoKey.
+float cachedLogAverage(LuminanceCacheEntry* entry, LuminanceSlot slot, const std::function<float()>& compute,
+                       float* autoKey){
+    if(entry == nullptr || !entry->keyed)
+        return compute();
+
+    LuminanceCacheRecord& record = entry->record;
+
+    bool keyCached = autoKey == nullptr || (record.autoKeySlots & (1u << slot));
+    if((record.validSlots & (1u << slot)) && keyCached){
+        cacheHits++;
+        savedMicros += (int64_t)(record.seconds[slot] * 1e6);
+        if(autoKey != nullptr)
+            *autoKey = record.autoKey[slot];
+        return record.logAverage[slot];
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    float logAverage = compute();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    cacheMisses++;
+    record.validSlots |= 1u << slot;
+    record.logAverage[slot] = logAverage;
+    record.seconds[slot] = elapsed.count();
+    if(autoKey != nullptr){
+        record.autoKeySlots |= 1u << slot;
+        record.autoKey[slot] = *autoKey;
+    }
+    entry->dirty = true;
+    return logAverage;
+}
+
+// A sidecar that cannot be written only costs the next run a miss, so failures are ignored.
+void storeLuminanceCache(const char* srcPath, const LuminanceCacheEntry& entry){
+    if(!entry.keyed || !entry.dirty)
+        return;
+
+    std::ofstream sidecar(sidecarPath(srcPath), std::ios::binary | std::ios::trunc);
+    sidecar.write(reinterpret_cast<const char*>(&entry.record), sizeof(entry.record));
+}
+
+void printLuminanceCacheStats(){
+    std::cout << "Luminance cache: " << cacheHits << " hits, " << cacheMisses << " misses, "
+              << savedMicros / 1e6 << " s saved" << std::endl;
+}
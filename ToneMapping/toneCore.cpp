@@ -0,0 +1,255 @@
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include "tone.h"
+#include "threadPool.h"
+
+// The in-memory core shared by the command line tool and libtonemap: the float planes, the
+// luminance pass, the Reinhard kernels' tile entry point and the BMP row encoder. Nothing here
+// touches the disk or calls exit(), so the library links this file and none of the CLI ones.
+
+// Sums log(delta + L) over [startIdx, endIdx). Each thread accumulates in a local double
+// and stores it once, so the partial sums neither lose precision nor share cache lines while running.
+// With an exposureHistogram every pixel is also counted in its exposureBin(). In deterministic mode
+// the sum is fixed-point log2 instead (see toneDeterministic.cpp).
+void luminanceChunk(size_t startIdx, size_t endIdx, const PlanarImage& input, double& partialSum,
+                    uint32_t* exposureHistogram){
+    if(deterministicMode()){
+        fixedLuminanceChunk(startIdx, endIdx, input, partialSum, exposureHistogram);
+        return;
+    }
+
+    double logSum = 0.0;
+    if(exposureHistogram == nullptr){
+        for(size_t i = startIdx; i < endIdx; i++){
+            RGBf pixel = {input.r[i], input.g[i], input.b[i]};
+            logSum += std::log((double)(LUMINANCE_DELTA + pixelLuminance(pixel)));
+        }
+    }
+    else {
+        for(size_t i = startIdx; i < endIdx; i++){
+            RGBf pixel = {input.r[i], input.g[i], input.b[i]};
+            float luminance = LUMINANCE_DELTA + pixelLuminance(pixel);
+            logSum += std::log((double)luminance);
+            exposureHistogram[exposureBin(luminance)]++;
+        }
+    }
+    partialSum = logSum;
+}
+
+// Same as luminanceChunk() over interleaved BGR rows.
+void luminanceRows(int startRow, int endRow, int width, const uint8_t* src, size_t srcStride, double& partialSum,
+                   uint32_t* exposureHistogram){
+    if(deterministicMode()){
+        fixedLuminanceRows(startRow, endRow, width, src, srcStride, partialSum, exposureHistogram);
+        return;
+    }
+
+    const float* normalize = normalizationLUT();
+    double logSum = 0.0;
+    for(int i = startRow; i < endRow; i++){
+        const uint8_t* row = src + i * srcStride;
+        if(exposureHistogram == nullptr){
+            for(int j = 0; j < width; j++){
+                RGBf pixel = {normalize[row[2]], normalize[row[1]], normalize[row[0]]};
+                logSum += std::log((double)(LUMINANCE_DELTA + pixelLuminance(pixel)));
+                row += 3;
+            }
+        }
+        else {
+            for(int j = 0; j < width; j++){
+                RGBf pixel = {normalize[row[2]], normalize[row[1]], normalize[row[0]]};
+                float luminance = LUMINANCE_DELTA + pixelLuminance(pixel);
+                logSum += std::log((double)luminance);
+                exposureHistogram[exposureBin(luminance)]++;
+                row += 3;
+            }
+        }
+    }
+    partialSum = logSum;
+}
+
+// Log-average luminance exp(mean(log(delta + L))). Every tile stores its own partial sum and
+// the sums are added in tile order, so the result does not depend on which worker ran which tile.
+// If exposureHistogram is given, the pass also fills one auto-exposure histogram per pool worker
+// and merges them into it.
+float logAverageLuminance(const PlanarImage& pixels, ThreadPool& pool, std::vector<uint64_t>* exposureHistogram){
+    int width = pixels.width;
+    int height = pixels.height;
+    std::vector<double> tileSums(pool.tileCount(height), 0.0);
+    std::vector<std::vector<uint32_t>> histograms;
+    if(exposureHistogram != nullptr)
+        histograms.assign(pool.size(), std::vector<uint32_t>(EXPOSURE_HISTOGRAM_BINS, 0));
+
+    pool.parallelFor(tileSums.size(), [&](int tile, int worker){
+        luminanceChunk((size_t)pool.tileStart(tile) * width, (size_t)pool.tileEnd(tile, height) * width, pixels,
+                       tileSums[tile], histograms.empty() ? nullptr : histograms[worker].data());
+    });
+
+    double logSum = 0.0;
+    for(double tileSum : tileSums){
+        logSum += tileSum;
+    }
+    if(exposureHistogram != nullptr)
+        mergeExposureHistograms(histograms, *exposureHistogram);
+
+    return logAverageFromSum(logSum, pixels.size());
+}
+
+// Log-average luminance of interleaved BGR rows, reduced over row tiles like logAverageLuminance().
+float logAverageLuminanceRows(const uint8_t* src, int width, int height, size_t srcStride, ThreadPool& pool,
+                              std::vector<uint64_t>* exposureHistogram){
+    std::vector<double> tileSums(pool.tileCount(height), 0.0);
+    std::vector<std::vector<uint32_t>> histograms;
+    if(exposureHistogram != nullptr)
+        histograms.assign(pool.size(), std::vector<uint32_t>(EXPOSURE_HISTOGRAM_BINS, 0));
+
+    pool.parallelFor(tileSums.size(), [&](int tile, int worker){
+        luminanceRows(pool.tileStart(tile), pool.tileEnd(tile, height), width, src, srcStride, tileSums[tile],
+                      histograms.empty() ? nullptr : histograms[worker].data());
+    });
+
+    double logSum = 0.0;
+    for(double tileSum : tileSums){
+        logSum += tileSum;
+    }
+    if(exposureHistogram != nullptr)
+        mergeExposureHistograms(histograms, *exposureHistogram);
+
+    return logAverageFromSum(logSum, (size_t)width * height);
+}
+
+PlanarImage::PlanarImage() : r(nullptr), g(nullptr), b(nullptr), width(0), height(0), buffer(nullptr), capacity(0) {}
+
+PlanarImage::~PlanarImage(){
+    free(buffer);
+}
+
+// Same as resize(), but returns false instead of exiting when the planes cannot be allocated.
+bool PlanarImage::tryResize(size_t newWidth, size_t newHeight, ThreadPool* pool){
+    const size_t floatsPerLine = PLANE_ALIGNMENT / sizeof(float);
+    size_t planeFloats = (newWidth * newHeight + floatsPerLine - 1) / floatsPerLine * floatsPerLine;
+
+    if(planeFloats * 3 > capacity){
+        free(buffer);
+        buffer = static_cast<float*>(aligned_alloc(PLANE_ALIGNMENT, planeFloats * 3 * sizeof(float)));
+        capacity = 0;
+        width = height = 0;
+        r = g = b = nullptr;
+        if(buffer == nullptr)
+            return false;
+        capacity = planeFloats * 3;
+
+        if(pool != nullptr){
+            firstTouchRows(buffer, newWidth * sizeof(float), newHeight, *pool);
+            firstTouchRows(buffer + planeFloats, newWidth * sizeof(float), newHeight, *pool);
+            firstTouchRows(buffer + planeFloats * 2, newWidth * sizeof(float), newHeight, *pool);
+        }
+    }
+
+    width = newWidth;
+    height = newHeight;
+    r = buffer;
+    g = buffer + planeFloats;
+    b = buffer + planeFloats * 2;
+    return true;
+}
+
+// Writes one byte per page of a freshly allocated buffer of height rows, tile by tile on the pool.
+// Linux places a page on the NUMA node of the thread that first touches it, and parallelFor()
+// deals every job's tiles out to the workers in the same contiguous blocks, so each worker's band
+// ends up on its own node for all later stages. Contents are garbage afterwards.
+void firstTouchRows(void* data, size_t rowBytes, int height, ThreadPool& pool){
+    const size_t pageSize = 4096;
+    uint8_t* bytes = static_cast<uint8_t*>(data);
+
+    pool.parallelFor(pool.tileCount(height), [&](int tile, int){
+        uint8_t* begin = bytes + pool.tileStart(tile) * rowBytes;
+        uint8_t* end = bytes + pool.tileEnd(tile, height) * rowBytes;
+        for(uint8_t* page = begin; page < end; page += pageSize){
+            *page = 0;
+        }
+    });
+}
+
+// Function to apply Reinhard tone mapping to a pixel
+RGBf toneMapReinhard(RGBf color, float avgLum, float a) {
+    // Calculate luminance
+    RGBf luminanceWeights = {0.2126f, 0.7152f, 0.0722f};
+    float L = luminanceWeights.r * color.r + luminanceWeights.g * color.g + luminanceWeights.b * color.b;
+    
+    // Scale luminance based on exposure key
+    float L_scaled = (a / avgLum) * L;
+    
+    // Apply Reinhard tone mapping
+    float L_mapped = L_scaled / (1.0f + L_scaled);
+    
+
+    if (L < 1e-5f) return {0.0f, 0.0f, 0.0f};
+    
+    // Preserve color ratio (preserves chrominance)
+    RGBf result;
+    result.r = color.r * (L_mapped / L);
+    result.g = color.g * (L_mapped / L);
+    result.b = color.b * (L_mapped / L);
+    
+    return result;
+}
+
+// Denormalize back to 0-255 range
+RGB toOutputPixel(RGBf mappedPixel){
+    RGB outPixel;
+    outPixel.r = static_cast<uint8_t>(std::min(std::max(mappedPixel.r * 255.0f, 0.0f), 255.0f));
+    outPixel.g = static_cast<uint8_t>(std::min(std::max(mappedPixel.g * 255.0f, 0.0f), 255.0f));
+    outPixel.b = static_cast<uint8_t>(std::min(std::max(mappedPixel.b * 255.0f, 0.0f), 255.0f));
+    return outPixel;
+}
+
+// Function that will be executed by each thread
+void processChunk(size_t startIdx, size_t endIdx, const PlanarImage& input, 
+                 RGBBuffer& output, float avgLum, float exposureKey) {
+    if (endIdx <= startIdx)
+        return;
+
+    // Scalar, SSE4.1 or AVX2 depending on the CPU (see reinhardKernels.cpp)
+    ReinhardKernel kernel = selectedReinhardKernel();
+    kernel(input.r + startIdx, input.g + startIdx, input.b + startIdx, output.data() + startIdx,
+           endIdx - startIdx, avgLum, exposureKey);
+}
+
+// Writes rows [startRow, endRow) of RGB pixels as BGR into a padded pixel array.
+void encodeBMPRows(int startRow, int endRow, int width, const RGB* pixels, uint8_t* dst, size_t dstStride){
+    for(int i = startRow; i < endRow; i++){
+        const RGB* in = pixels + (size_t)i * width;
+        uint8_t* out = dst + i * dstStride;
+
+        for(int j = 0; j < width; j++){
+            out[0] = in[j].b;
+            out[1] = in[j].g;
+            out[2] = in[j].r;
+            out += 3;
+        }
+    }
+}
+
+// Builds the whole padded BGR pixel array, each tile of rows filled by one worker. The array is not
+// zeroed up front, which would first-touch every page on the calling thread; the worker that
+// encodes a row also clears its padding. (encodeBMPRows() itself leaves the bytes past the pixels
+// alone, since libtonemap encodes into the caller's rows.)
+void encodeBMPPixelArray(const RGBBuffer& pixels, int width, int height, BMPPixelArray& pixelArray,
+                         ThreadPool& pool){
+    size_t rowStride = bmpRowStride(width);
+    size_t pixelBytes = 3 * (size_t)width;
+    pixelArray.resize(rowStride * height);
+
+    pool.parallelFor(pool.tileCount(height), [&](int tile, int){
+        int start = pool.tileStart(tile);
+        int end = pool.tileEnd(tile, height);
+        encodeBMPRows(start, end, width, pixels.data(), pixelArray.data(), rowStride);
+        for(int i = start; i < end && pixelBytes < rowStride; i++){
+            memset(pixelArray.data() + i * rowStride + pixelBytes, 0, rowStride - pixelBytes);
+        }
+    });
+}
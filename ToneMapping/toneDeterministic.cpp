@@ -0,0 +1,173 @@
+#include <immintrin.h>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include "tone.h"
+
+// Deterministic mode (--deterministic): output that is bit-identical for any thread count, tile
+// size, --stream budget, file path (stream, mmap, strips, sequence) and Reinhard kernel ISA.
+//
+// The float log sum is the only order-dependent step of the pipeline. Here every pixel's
+// log2(delta + L) is computed in fixed point instead: the float's exponent plus a table of
+// log2(1 + m) over the top 12 mantissa bits, linearly interpolated in integers over the other 11
+// (error about 1e-8), rounded to FIXED_LOG_FRACTION_BITS. Integer sums are associative, and they
+// stay exact in the double partial sums the luminance passes already use for images below about a
+// billion pixels (2^53 / (128 * 2^16)), so the tiles can be added in any grouping. The AVX2 loop
+// gathers from the table and matches the scalar one bit for bit.
+//
+// Luminance is computed as (wr r + wg g) + wb b everywhere, the order of the SIMD kernels. The
+// mapping uses the exact kernels of reinhardKernels.cpp, which divide instead of using rcpps (whose
+// approximation differs between CPU vendors) and share one formula between scalar, SSE4.1 and AVX2.
+//
+// Builds that let the compiler fuse multiplies and adds (-mfma, -march=native) should add
+// -ffp-contract=off to get the same bits as other builds; thread counts agree regardless.
+
+static const int FIXED_LOG_TABLE_BITS = 12;
+static const int FIXED_LOG_INTERPOLATION_BITS = 23 - FIXED_LOG_TABLE_BITS;
+static const int FIXED_LOG_TABLE_SHIFT = 24;    // table entries are log2(1 + m) * 2^24
+static const int FIXED_LOG_FRACTION_BITS = 16;  // per-pixel values are log2 * 2^16
+
+static bool deterministic = false;
+
+void selectDeterministicMode(bool enabled){
+    deterministic = enabled;
+}
+
+bool deterministicMode(){
+    return deterministic;
+}
+
+// log2(1 + k / 4096) * 2^24 for k = 0 .. 4096, the last entry closes the interpolation.
+static const int32_t* fixedLog2Table(){
+    static const std::vector<int32_t> table = []{
+        std::vector<int32_t> values((1 << FIXED_LOG_TABLE_BITS) + 1);
+        for(size_t k = 0; k < values.size(); k++){
+            double mantissa = 1.0 + (double)k / (1 << FIXED_LOG_TABLE_BITS);
+            values[k] = (int32_t)std::lround(std::log2(mantissa) * (1 << FIXED_LOG_TABLE_SHIFT));
+        }
+        return values;
+    }();
+    return table.data();
+}
+
+// log2(value) * 2^16 for a positive normal float.
+static inline int32_t fixedLog2(float value, const int32_t* table){
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    int32_t exponent = (int32_t)(bits >> 23) - 127;
+    uint32_t index = (bits >> FIXED_LOG_INTERPOLATION_BITS) & ((1u << FIXED_LOG_TABLE_BITS) - 1);
+    int32_t fraction = bits & ((1u << FIXED_LOG_INTERPOLATION_BITS) - 1);
+
+    int32_t low = table[index];
+    int32_t mantissaLog = low + (((table[index + 1] - low) * fraction) >> FIXED_LOG_INTERPOLATION_BITS);
+    int32_t rounding = 1 << (FIXED_LOG_TABLE_SHIFT - FIXED_LOG_FRACTION_BITS - 1);
+    return exponent * (1 << FIXED_LOG_FRACTION_BITS) + ((mantissaLog + rounding) >> (FIXED_LOG_TABLE_SHIFT - FIXED_LOG_FRACTION_BITS));
+}
+
+static inline float deterministicLuminance(float r, float g, float b){
+    return LUMINANCE_DELTA + (LUMINANCE_WEIGHTS.r * r + LUMINANCE_WEIGHTS.g * g + LUMINANCE_WEIGHTS.b * b);
+}
+
+static int64_t fixedLogSumScalar(const float* r, const float* g, const float* b, size_t count,
+                                 uint32_t* exposureHistogram){
+    const int32_t* table = fixedLog2Table();
+    int64_t sum = 0;
+    for(size_t i = 0; i < count; i++){
+        float luminance = deterministicLuminance(r[i], g[i], b[i]);
+        sum += fixedLog2(luminance, table);
+        if(exposureHistogram != nullptr)
+            exposureHistogram[exposureBin(luminance)]++;
+    }
+    return sum;
+}
+
+__attribute__((target("avx2")))
+static int64_t fixedLogSumAVX2(const float* r, const float* g, const float* b, size_t count,
+                               uint32_t* exposureHistogram){
+    const int32_t* table = fixedLog2Table();
+    const __m256 wr = _mm256_set1_ps(LUMINANCE_WEIGHTS.r);
+    const __m256 wg = _mm256_set1_ps(LUMINANCE_WEIGHTS.g);
+    const __m256 wb = _mm256_set1_ps(LUMINANCE_WEIGHTS.b);
+    const __m256 delta = _mm256_set1_ps(LUMINANCE_DELTA);
+    const __m256i bias = _mm256_set1_epi32(127);
+    const __m256i indexMask = _mm256_set1_epi32((1 << FIXED_LOG_TABLE_BITS) - 1);
+    const __m256i fractionMask = _mm256_set1_epi32((1 << FIXED_LOG_INTERPOLATION_BITS) - 1);
+    const __m256i rounding = _mm256_set1_epi32(1 << (FIXED_LOG_TABLE_SHIFT - FIXED_LOG_FRACTION_BITS - 1));
+
+    __m256i sum = _mm256_setzero_si256();
+    size_t i = 0;
+    for(; i + 8 <= count; i += 8){
+        __m256 rv = _mm256_loadu_ps(r + i);
+        __m256 gv = _mm256_loadu_ps(g + i);
+        __m256 bv = _mm256_loadu_ps(b + i);
+        __m256 L = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(wr, rv), _mm256_mul_ps(wg, gv)), _mm256_mul_ps(wb, bv));
+        __m256i bits = _mm256_castps_si256(_mm256_add_ps(delta, L));
+
+        __m256i exponent = _mm256_sub_epi32(_mm256_srli_epi32(bits, 23), bias);
+        __m256i index = _mm256_and_si256(_mm256_srli_epi32(bits, FIXED_LOG_INTERPOLATION_BITS), indexMask);
+        __m256i fraction = _mm256_and_si256(bits, fractionMask);
+
+        __m256i low = _mm256_i32gather_epi32(table, index, 4);
+        __m256i high = _mm256_i32gather_epi32(table + 1, index, 4);
+        __m256i step = _mm256_srai_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(high, low), fraction),
+                                         FIXED_LOG_INTERPOLATION_BITS);
+        __m256i mantissaLog = _mm256_srai_epi32(_mm256_add_epi32(_mm256_add_epi32(low, step), rounding),
+                                                FIXED_LOG_TABLE_SHIFT - FIXED_LOG_FRACTION_BITS);
+        __m256i value = _mm256_add_epi32(_mm256_slli_epi32(exponent, FIXED_LOG_FRACTION_BITS), mantissaLog);
+
+        sum = _mm256_add_epi64(sum, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(value)));
+        sum = _mm256_add_epi64(sum, _mm256_cvtepi32_epi64(_mm256_extracti128_si256(value, 1)));
+
+        if(exposureHistogram != nullptr){
+            alignas(32) float luminance[8];
+            _mm256_store_si256(reinterpret_cast<__m256i*>(luminance), bits);
+            for(int k = 0; k < 8; k++){
+                exposureHistogram[exposureBin(luminance[k])]++;
+            }
+        }
+    }
+
+    alignas(32) int64_t lanes[4];
+    _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), sum);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + fixedLogSumScalar(r + i, g + i, b + i, count - i, exposureHistogram);
+}
+
+// Deterministic luminanceChunk(): partialSum is the exact fixed-point sum, see logAverageFromSum().
+void fixedLuminanceChunk(size_t startIdx, size_t endIdx, const PlanarImage& input, double& partialSum,
+                         uint32_t* exposureHistogram){
+    size_t count = endIdx - startIdx;
+    if(kernelISASupported(ISA_AVX2))
+        partialSum = (double)fixedLogSumAVX2(input.r + startIdx, input.g + startIdx, input.b + startIdx, count,
+                                             exposureHistogram);
+    else
+        partialSum = (double)fixedLogSumScalar(input.r + startIdx, input.g + startIdx, input.b + startIdx, count,
+                                               exposureHistogram);
+}
+
+// Deterministic luminanceRows() over interleaved BGR rows.
+void fixedLuminanceRows(int startRow, int endRow, int width, const uint8_t* src, size_t srcStride,
+                        double& partialSum, uint32_t* exposureHistogram){
+    const float* normalize = normalizationLUT();
+    const int32_t* table = fixedLog2Table();
+    int64_t sum = 0;
+
+    for(int i = startRow; i < endRow; i++){
+        const uint8_t* row = src + i * srcStride;
+        for(int j = 0; j < width; j++){
+            float luminance = deterministicLuminance(normalize[row[2]], normalize[row[1]], normalize[row[0]]);
+            sum += fixedLog2(luminance, table);
+            if(exposureHistogram != nullptr)
+                exposureHistogram[exposureBin(luminance)]++;
+            row += 3;
+        }
+    }
+    partialSum = (double)sum;
+}
+
+// Log-average luminance from the sum of all tiles' partial sums: natural logs normally, fixed-point
+// log2 in deterministic mode.
+float logAverageFromSum(double logSum, size_t totalPixels){
+    if(deterministic)
+        return (float)std::exp2(logSum / ((double)(1 << FIXED_LOG_FRACTION_BITS) * totalPixels));
+    return (float)std::exp(logSum / totalPixels);
+}
@@ -0,0 +1,96 @@
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include "tone.h"
+
+// Automatic exposure ([exposure_key] "auto"). The luminance pass also fills a histogram of
+// delta + L in about 1/16 stop bins, one per pool worker and merged at the end, so choosing the key costs no extra
+// sweep over the image. The LUT path reuses the quantized-luminance histogram it already builds.
+//
+// The key follows Reinhard's estimate ("Parameter Estimation for Photographic Tone Reproduction",
+// 2002): with Lmin and Lmax taken as robust percentiles,
+//
+//   key = 0.18 * 4^((2 log2 Lavg - log2 Lmin - log2 Lmax) / (log2 Lmax - log2 Lmin))
+//
+// so a log average near the dark end of the range gives a low key and one near the bright end a
+// high key, between 0.045 and 0.72.
+
+static const double AUTO_EXPOSURE_LOW_PERCENTILE = 0.01;
+static const double AUTO_EXPOSURE_HIGH_PERCENTILE = 0.99;
+static const double AUTO_EXPOSURE_BASE_KEY = 0.18;
+
+// Index of the bin holding the given fraction of the pixels, counted from the darkest bin.
+static size_t percentileBin(const std::vector<uint64_t>& histogram, double fraction){
+    uint64_t total = 0;
+    for(uint64_t count : histogram){
+        total += count;
+    }
+
+    uint64_t target = (uint64_t)std::ceil(fraction * total);
+    uint64_t seen = 0;
+    for(size_t bin = 0; bin < histogram.size(); bin++){
+        seen += histogram[bin];
+        if(seen >= std::max<uint64_t>(target, 1))
+            return bin;
+    }
+    return histogram.size() - 1;
+}
+
+static float estimateKey(double log2Average, double log2Min, double log2Max){
+    if(log2Max - log2Min < 1e-6)
+        return (float)AUTO_EXPOSURE_BASE_KEY;
+    double exponent = (2.0 * log2Average - log2Min - log2Max) / (log2Max - log2Min);
+    exponent = std::min(1.0, std::max(-1.0, exponent));
+    return (float)(AUTO_EXPOSURE_BASE_KEY * std::pow(4.0, exponent));
+}
+
+// log2 of the float in the middle of an exposureBin().
+static double exposureBinLog2(size_t bin){
+    uint32_t bits = ((uint32_t)(bin + ((127 + EXPOSURE_MIN_STOP) << 4)) << 19) | (1u << 18);
+    float luminance;
+    memcpy(&luminance, &bits, sizeof(luminance));
+    return std::log2((double)luminance);
+}
+
+float autoExposureKey(float logAverage, const std::vector<uint64_t>& histogram){
+    double log2Min = exposureBinLog2(percentileBin(histogram, AUTO_EXPOSURE_LOW_PERCENTILE));
+    double log2Max = exposureBinLog2(percentileBin(histogram, AUTO_EXPOSURE_HIGH_PERCENTILE));
+    return estimateKey(std::log2((double)logAverage), log2Min, log2Max);
+}
+
+float autoExposureKeyBins(float logAverage, const std::vector<uint64_t>& histogram,
+                          const std::function<double(size_t bin)>& binLuminance){
+    double lowLuminance = binLuminance(percentileBin(histogram, AUTO_EXPOSURE_LOW_PERCENTILE));
+    double highLuminance = binLuminance(percentileBin(histogram, AUTO_EXPOSURE_HIGH_PERCENTILE));
+    return estimateKey(std::log2((double)logAverage), std::log2(LUMINANCE_DELTA + lowLuminance),
+                       std::log2(LUMINANCE_DELTA + highLuminance));
+}
+
+void mergeExposureHistograms(const std::vector<std::vector<uint32_t>>& workerHistograms,
+                             std::vector<uint64_t>& histogram){
+    histogram.assign(EXPOSURE_HISTOGRAM_BINS, 0);
+    for(const auto& workerHistogram : workerHistograms){
+        for(int bin = 0; bin < EXPOSURE_HISTOGRAM_BINS; bin++){
+            histogram[bin] += workerHistogram[bin];
+        }
+    }
+}
+
+// Log average of the float planes (through the --stats-cache slot, which also keeps the automatic key)
+// and the key to map them with: options.exposureKey, or the automatic key if it is 0.
+float planarLogAverage(const ToneOptions& options, const PlanarImage& pixels, ThreadPool& pool, float& exposureKey){
+    exposureKey = options.exposureKey;
+    bool autoExposure = exposureKey == 0.0f;
+
+    return cachedLogAverage(options.luminanceCache, LUMINANCE_SLOT_FLOAT, [&]{
+        if(!autoExposure)
+            return logAverageLuminance(pixels, pool);
+
+        std::vector<uint64_t> histogram;
+        float logAverage = logAverageLuminance(pixels, pool, &histogram);
+        exposureKey = autoExposureKey(logAverage, histogram);
+        return logAverage;
+    }, autoExposure ? &exposureKey : nullptr);
+}
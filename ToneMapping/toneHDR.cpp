@@ -0,0 +1,331 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <cfloat>
+#include <cstring>
+#include <cstdio>
+#include <cctype>
+#include <algorithm>
+#include <sys/stat.h>
+#include "tone.h"
+#include "threadPool.h"
+
+// High dynamic range input. PFM and Radiance RGBE (.hdr) files are decoded straight into the
+// float planes of a PlanarImage (row 0 at the bottom, like the BMP path) and go through the same
+// log-average and Reinhard kernels; the output is a 24-bit BMP.
+//
+// New-style RGBE files run-length encode every scanline separately. One serial sweep over the
+// run headers finds where each scanline starts, then the scanlines are decoded by the pool.
+
+static bool hasExtension(const char* path, const char* extension){
+    size_t length = strlen(path);
+    size_t extensionLength = strlen(extension);
+    return length >= extensionLength && strcmp(path + length - extensionLength, extension) == 0;
+}
+
+bool isHDRPath(const char* path){
+    return hasExtension(path, ".pfm") || hasExtension(path, ".hdr");
+}
+
+// Negative, NaN and infinite samples would poison the log average.
+static inline float sanitize(float value){
+    return value > 0.0f ? std::min(value, FLT_MAX) : 0.0f;
+}
+
+static std::vector<uint8_t> readWholeFile(const char* path){
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if(!file){
+        std::cerr << "Error: Cannot open file " << path << std::endl;
+        exit(1);
+    }
+
+    std::vector<uint8_t> data((size_t)file.tellg());
+    file.seekg(0, std::ios::beg);
+    file.read(reinterpret_cast<char*>(data.data()), data.size());
+    if(!file){
+        std::cerr << "Error: Cannot read file " << path << std::endl;
+        exit(1);
+    }
+    return data;
+}
+
+// Reads one whitespace separated token of a PFM header.
+static std::string headerToken(const std::vector<uint8_t>& data, size_t& pos){
+    while(pos < data.size() && isspace(data[pos]))
+        pos++;
+    size_t start = pos;
+    while(pos < data.size() && !isspace(data[pos]))
+        pos++;
+    return std::string(data.begin() + start, data.begin() + pos);
+}
+
+// "PF" (RGB) or "Pf" (grey), width, height, scale (negative means little endian), one whitespace
+// byte, then float rows from the bottom up.
+void readPFM(const char* path, PlanarImage& output, ThreadPool& pool){
+    std::vector<uint8_t> data = readWholeFile(path);
+    size_t pos = 0;
+
+    std::string magic = headerToken(data, pos);
+    int width = std::atoi(headerToken(data, pos).c_str());
+    int height = std::atoi(headerToken(data, pos).c_str());
+    float scale = std::atof(headerToken(data, pos).c_str());
+    pos++;
+
+    if((magic != "PF" && magic != "Pf") || width <= 0 || height <= 0 || scale == 0.0f){
+        std::cerr << "Error: " << path << " is not a valid PFM file" << std::endl;
+        exit(1);
+    }
+
+    int channels = magic == "PF" ? 3 : 1;
+    size_t count = (size_t)width * height * channels;
+    if(pos > data.size() || data.size() - pos < count * sizeof(float)){
+        std::cerr << "Error: Unexpected end of pixel data" << std::endl;
+        exit(1);
+    }
+
+    bool swapBytes = (scale > 0.0f) != (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__);
+    output.resize(width, height, &pool);
+
+    // Converted tile by tile on the workers that first touched the planes.
+    const uint8_t* pixels = data.data() + pos;
+    pool.parallelFor(pool.tileCount(height), [&](int tile, int){
+        size_t start = (size_t)pool.tileStart(tile) * width;
+        size_t end = (size_t)pool.tileEnd(tile, height) * width;
+        const uint8_t* src = pixels + start * channels * sizeof(float);
+
+        for(size_t i = start; i < end; i++){
+            float values[3];
+            for(int c = 0; c < channels; c++){
+                uint32_t bits;
+                memcpy(&bits, src, 4);
+                if(swapBytes)
+                    bits = __builtin_bswap32(bits);
+                memcpy(&values[c], &bits, 4);
+                src += 4;
+            }
+            output.r[i] = sanitize(values[0]);
+            output.g[i] = sanitize(values[channels == 3 ? 1 : 0]);
+            output.b[i] = sanitize(values[channels == 3 ? 2 : 0]);
+        }
+    });
+}
+
+static inline void storeRGBE(const uint8_t* rgbe, PlanarImage& output, size_t index){
+    if(rgbe[3] == 0){
+        output.r[index] = output.g[index] = output.b[index] = 0.0f;
+        return;
+    }
+    float factor = std::ldexp(1.0f, rgbe[3] - (128 + 8));
+    output.r[index] = rgbe[0] * factor;
+    output.g[index] = rgbe[1] * factor;
+    output.b[index] = rgbe[2] * factor;
+}
+
+// New-style scanlines start with 2, 2 and the 15-bit width, then hold four run-length coded
+// channel planes. Returns false for flat or old-style files.
+static bool isNewRLE(const uint8_t* src, size_t available, int width){
+    return width >= 8 && width < 32768 && available >= 4 && src[0] == 2 && src[1] == 2 && (src[2] & 0x80) == 0
+           && ((src[2] << 8) | src[3]) == width;
+}
+
+// Returns the offset just past the scanline starting at pos, or 0 if it is truncated.
+static size_t skipRLEScanline(const std::vector<uint8_t>& data, size_t pos, int width){
+    pos += 4;
+    for(int c = 0; c < 4; c++){
+        int filled = 0;
+        while(filled < width){
+            if(pos >= data.size())
+                return 0;
+            int count = data[pos++];
+            bool run = count > 128;
+            if(run)
+                count -= 128;
+            if(count == 0 || filled + count > width)
+                return 0;
+            pos += run ? 1 : count;
+            filled += count;
+        }
+    }
+    return pos <= data.size() ? pos : 0;
+}
+
+static void decodeRLEScanline(const uint8_t* src, int width, PlanarImage& output, size_t firstPixel){
+    std::vector<uint8_t> scanline((size_t)width * 4);
+    src += 4;
+
+    for(int c = 0; c < 4; c++){
+        int filled = 0;
+        while(filled < width){
+            int count = *src++;
+            if(count > 128){
+                count -= 128;
+                for(int i = 0; i < count; i++){
+                    scanline[(filled + i) * 4 + c] = *src;
+                }
+                src++;
+            }
+            else {
+                for(int i = 0; i < count; i++){
+                    scanline[(filled + i) * 4 + c] = *src++;
+                }
+            }
+            filled += count;
+        }
+    }
+
+    for(int j = 0; j < width; j++){
+        storeRGBE(&scanline[j * 4], output, firstPixel + j);
+    }
+}
+
+// Flat pixels with old-style runs (1, 1, 1, n repeats the previous pixel n << shift times).
+static void decodeFlatPixels(const std::vector<uint8_t>& data, size_t pos, int width, int height, bool topDown,
+                             PlanarImage& output){
+    size_t total = (size_t)width * height;
+    size_t pixel = 0;
+    int shift = 0;
+    uint8_t previous[4] = {0, 0, 0, 0};
+
+    auto store = [&](const uint8_t* rgbe){
+        size_t row = pixel / width;
+        size_t index = (topDown ? height - 1 - row : row) * width + pixel % width;
+        storeRGBE(rgbe, output, index);
+        pixel++;
+    };
+
+    while(pixel < total){
+        if(pos + 4 > data.size()){
+            std::cerr << "Error: Unexpected end of pixel data" << std::endl;
+            exit(1);
+        }
+        const uint8_t* rgbe = &data[pos];
+        pos += 4;
+
+        if(rgbe[0] == 1 && rgbe[1] == 1 && rgbe[2] == 1){
+            size_t repeat = (size_t)rgbe[3] << shift;
+            for(size_t i = 0; i < repeat && pixel < total; i++){
+                store(previous);
+            }
+            shift += 8;
+        }
+        else {
+            store(rgbe);
+            memcpy(previous, rgbe, 4);
+            shift = 0;
+        }
+    }
+}
+
+void readRGBE(const char* path, PlanarImage& output, ThreadPool& pool){
+    std::vector<uint8_t> data = readWholeFile(path);
+    size_t pos = 0;
+
+    auto readLine = [&](){
+        size_t start = pos;
+        while(pos < data.size() && data[pos] != '\n')
+            pos++;
+        std::string line(data.begin() + start, data.begin() + pos);
+        // The last line may have no newline; pos never goes past the end.
+        if(pos < data.size())
+            pos++;
+        return line;
+    };
+
+    std::string line = readLine();
+    if(line.compare(0, 2, "#?") != 0){
+        std::cerr << "Error: " << path << " is not a Radiance HDR file" << std::endl;
+        exit(1);
+    }
+
+    // Header lines up to the first empty one; only the pixel format matters here.
+    while(pos < data.size()){
+        line = readLine();
+        if(line.empty())
+            break;
+        if(line.compare(0, 7, "FORMAT=") == 0 && line != "FORMAT=32-bit_rle_rgbe"){
+            std::cerr << "Error: Unsupported HDR pixel format " << line.substr(7) << std::endl;
+            exit(1);
+        }
+    }
+
+    // Only unrotated images: "-Y height +X width" (top-down) or "+Y height +X width".
+    char ySign, xSign;
+    int height = 0, width = 0;
+    line = readLine();
+    if(sscanf(line.c_str(), "%cY %d %cX %d", &ySign, &height, &xSign, &width) != 4 || xSign != '+'
+       || (ySign != '-' && ySign != '+') || width <= 0 || height <= 0){
+        std::cerr << "Error: Unsupported HDR resolution line \"" << line << "\"" << std::endl;
+        exit(1);
+    }
+    bool topDown = ySign == '-';
+
+    output.resize(width, height, &pool);
+
+    if(pos >= data.size()){
+        std::cerr << "Error: Unexpected end of pixel data" << std::endl;
+        exit(1);
+    }
+    if(!isNewRLE(data.data() + pos, data.size() - pos, width)){
+        decodeFlatPixels(data, pos, width, height, topDown, output);
+        return;
+    }
+
+    std::vector<size_t> scanlineStarts(height);
+    for(int i = 0; i < height; i++){
+        if(pos >= data.size()){
+            std::cerr << "Error: Unexpected end of pixel data" << std::endl;
+            exit(1);
+        }
+        if(!isNewRLE(data.data() + pos, data.size() - pos, width)){
+            std::cerr << "Error: Corrupt HDR scanline " << i << std::endl;
+            exit(1);
+        }
+        scanlineStarts[i] = pos;
+        pos = skipRLEScanline(data, pos, width);
+        if(pos == 0){
+            std::cerr << "Error: Corrupt HDR scanline " << i << std::endl;
+            exit(1);
+        }
+    }
+
+    pool.parallelFor(pool.tileCount(height), [&](int tile, int){
+        for(int i = pool.tileStart(tile); i < pool.tileEnd(tile, height); i++){
+            size_t row = topDown ? height - 1 - i : i;
+            decodeRLEScanline(data.data() + scanlineStarts[i], width, output, row * width);
+        }
+    });
+}
+
+void readHDR(const char* path, PlanarImage& output, ThreadPool& pool){
+    if(hasExtension(path, ".pfm"))
+        readPFM(path, output, pool);
+    else
+        readRGBE(path, output, pool);
+}
+
+float toneMapHDR(const ToneOptions& options, ThreadPool& pool){
+    StageTimer stage(&pool);
+    stage.begin("decode");
+    PlanarImage pixels;
+    readHDR(options.srcPath, pixels, pool);
+    struct stat fileInfo;
+    stage.count(stat(options.srcPath, &fileInfo) == 0 ? fileInfo.st_size : 0, 0, pixels.size());
+
+    stage.begin("luminance");
+    ToneOptions mapOptions = options;
+    float logAvgLuminance = planarLogAverage(options, pixels, pool, mapOptions.exposureKey);
+    stage.count(0, 0, pixels.size());
+
+    stage.begin("map");
+    RGBBuffer outputPixels;
+    toneMapPlanar(mapOptions, pixels, logAvgLuminance, outputPixels, pool);
+    stage.count(0, 0, pixels.size());
+
+    stage.begin("encode + write");
+    writeBMPImage(options.targetPath, outputPixels, pixels.width, pixels.height, pool);
+    stage.count(0, BMP_HEADER_SIZE + bmpRowStride(pixels.width) * pixels.height, pixels.size());
+
+    return logAvgLuminance;
+}
@@ -0,0 +1,154 @@
+#include <cmath>
+#include <algorithm>
+#include "tone.h"
+#include "threadPool.h"
+
+// Lookup-table fast path for 8-bit input. Luminance is computed in 16.16 fixed point from the
+// byte values and quantized to LUT_LUMINANCE_BITS bits. The luminance pass only builds a histogram
+// of the quantized values, so log() runs once per bin instead of once per pixel. Once the
+// log average is known, the Reinhard factor s / (1 + sL) for every bin goes into a 16.16 table
+// and the mapping loop is integer only: out = min(255, (C * table[q]) >> 16).
+
+// Luminance weights scaled by 2^16, they add up to exactly 65536.
+static const uint32_t FIXED_WEIGHT_R = 13933;
+static const uint32_t FIXED_WEIGHT_G = 46871;
+static const uint32_t FIXED_WEIGHT_B = 4732;
+
+// Fixed-point luminance is at most 255 * 2^16 (24 bits), this keeps the top LUT_LUMINANCE_BITS.
+static const int LUMINANCE_SHIFT = 24 - LUT_LUMINANCE_BITS;
+
+// Any factor above 256 saturates every non-zero channel anyway; capping it keeps C * factor in 32 bits.
+static const uint32_t MAX_FIXED_FACTOR = (256u << 16) - 1;
+
+// Byte -> float input value: b / 255, or the sRGB decode table with --srgb.
+const float* normalizationLUT(){
+    if(selectedTransferFunction() == TRANSFER_SRGB)
+        return srgbDecodeLUT();
+
+    static const std::vector<float> table = []{
+        std::vector<float> values(256);
+        for(int i = 0; i < 256; i++){
+            values[i] = static_cast<float>(i) / 255.0f;
+        }
+        return values;
+    }();
+    return table.data();
+}
+
+static inline uint32_t quantizedLuminance(const uint8_t* bgr){
+    return (FIXED_WEIGHT_B * bgr[0] + FIXED_WEIGHT_G * bgr[1] + FIXED_WEIGHT_R * bgr[2]) >> LUMINANCE_SHIFT;
+}
+
+// Linear luminance at the center of bin q. Bin 0 only holds pure black, since the smallest
+// non-zero channel contribution (blue = 1) is already above one bin.
+static double binLuminance(uint32_t q){
+    if(q == 0)
+        return 0.0;
+    return (q + 0.5) * (1 << LUMINANCE_SHIFT) / (255.0 * 65536.0);
+}
+
+// Adds the rows to histogram, which must already hold LUT_LUMINANCE_SIZE bins.
+void luminanceHistogramRows(int startRow, int endRow, int width, const uint8_t* src, size_t srcStride,
+                            std::vector<uint32_t>& histogram){
+    uint32_t* bins = histogram.data();
+
+    for(int i = startRow; i < endRow; i++){
+        const uint8_t* row = src + i * srcStride;
+        for(int j = 0; j < width; j++){
+            bins[quantizedLuminance(row)]++;
+            row += 3;
+        }
+    }
+}
+
+float logAverageFromHistogram(const std::vector<uint64_t>& histogram, size_t totalPixels){
+    double logSum = 0.0;
+    for(uint32_t q = 0; q < histogram.size(); q++){
+        if(histogram[q] != 0)
+            logSum += histogram[q] * std::log(LUMINANCE_DELTA + binLuminance(q));
+    }
+    return (float)std::exp(logSum / totalPixels);
+}
+
+// One histogram per pool worker, merged once all tiles are done. The merged histogram is copied
+// to histogramOut if given.
+float logAverageLuminanceLUT(const uint8_t* src, int width, int height, size_t srcStride, ThreadPool& pool,
+                             std::vector<uint64_t>* histogramOut){
+    std::vector<std::vector<uint32_t>> histograms(pool.size(), std::vector<uint32_t>(LUT_LUMINANCE_SIZE, 0));
+
+    pool.parallelFor(pool.tileCount(height), [&](int tile, int worker){
+        luminanceHistogramRows(pool.tileStart(tile), pool.tileEnd(tile, height), width, src, srcStride,
+                               histograms[worker]);
+    });
+
+    std::vector<uint64_t> histogram(LUT_LUMINANCE_SIZE, 0);
+    for(const auto& workerHistogram : histograms){
+        for(int q = 0; q < LUT_LUMINANCE_SIZE; q++){
+            histogram[q] += workerHistogram[q];
+        }
+    }
+
+    if(histogramOut != nullptr)
+        *histogramOut = histogram;
+
+    return logAverageFromHistogram(histogram, (size_t)width * height);
+}
+
+// Automatic key (see toneExposure.cpp) from the quantized-luminance histogram of the LUT path.
+float autoExposureKeyLUT(float logAverage, const std::vector<uint64_t>& histogram){
+    return autoExposureKeyBins(logAverage, histogram, [](size_t bin){ return binLuminance(bin); });
+}
+
+void buildReinhardLUT(float avgLum, float exposureKey, std::vector<uint32_t>& table){
+    double scale = (double)exposureKey / avgLum;
+    table.resize(LUT_LUMINANCE_SIZE);
+
+    table[0] = 0;
+    for(uint32_t q = 1; q < (uint32_t)LUT_LUMINANCE_SIZE; q++){
+        double factor = scale / (1.0 + scale * binLuminance(q));
+        table[q] = (uint32_t)std::min<double>(MAX_FIXED_FACTOR, std::floor(factor * 65536.0 + 0.5));
+    }
+}
+
+// Integer only mapping of interleaved BGR rows into interleaved BGR rows.
+void lutMapRows(int startRow, int endRow, int width, const uint8_t* src, size_t srcStride,
+                uint8_t* dst, size_t dstStride, const uint32_t* table){
+    for(int i = startRow; i < endRow; i++){
+        const uint8_t* in = src + i * srcStride;
+        uint8_t* out = dst + i * dstStride;
+
+        for(int j = 0; j < width; j++){
+            uint32_t factor = table[quantizedLuminance(in)];
+            out[0] = (uint8_t)std::min<uint32_t>(255, (in[0] * factor) >> 16);
+            out[1] = (uint8_t)std::min<uint32_t>(255, (in[1] * factor) >> 16);
+            out[2] = (uint8_t)std::min<uint32_t>(255, (in[2] * factor) >> 16);
+            in += 3;
+            out += 3;
+        }
+    }
+}
+
+// Histogram pass, table build and integer mapping over row tiles. Returns the log-average luminance.
+// The histogram pass is skipped if luminanceCache already holds the LUT log average (and, for an
+// exposureKey of 0, the automatic key picked from the histogram).
+float toneMapLUT(const uint8_t* src, size_t srcStride, uint8_t* dst, size_t dstStride, int width, int height,
+                 float exposureKey, ThreadPool& pool, LuminanceCacheEntry* luminanceCache){
+    bool autoExposure = exposureKey == 0.0f;
+    float logAvgLuminance = cachedLogAverage(luminanceCache, LUMINANCE_SLOT_LUT, [&]{
+        std::vector<uint64_t> histogram;
+        float logAverage = logAverageLuminanceLUT(src, width, height, srcStride, pool, &histogram);
+        if(autoExposure)
+            exposureKey = autoExposureKeyLUT(logAverage, histogram);
+        return logAverage;
+    }, autoExposure ? &exposureKey : nullptr);
+
+    std::vector<uint32_t> table;
+    buildReinhardLUT(logAvgLuminance, exposureKey, table);
+
+    pool.parallelFor(pool.tileCount(height), [&](int tile, int){
+        lutMapRows(pool.tileStart(tile), pool.tileEnd(tile, height), width, src, srcStride, dst, dstStride,
+                   table.data());
+    });
+
+    return logAvgLuminance;
+}
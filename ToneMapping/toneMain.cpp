@@ -0,0 +1,63 @@
+#include <iostream>
+#include <cstring>
+#include <new>
+#include "tone.h"
+#include "threadPool.h"
+
+// Command line front end. Everything else builds into libtonemap as well (see tonemap.h).
+
+int main(int argc, char* argv[]){
+
+    if(argc >= 2 && strcmp(argv[1], "--bench-decode") == 0){
+        benchDecode(argc, argv);
+        return 0;
+    }
+    if(argc >= 2 && strcmp(argv[1], "--bench-kernel") == 0){
+        benchKernel(argc, argv);
+        return 0;
+    }
+    if(argc >= 2 && strcmp(argv[1], "--bench-lut") == 0){
+        benchLUT(argc, argv);
+        return 0;
+    }
+    if(argc >= 2 && strcmp(argv[1], "--bench-scaling") == 0){
+        benchScaling(argc, argv);
+        return 0;
+    }
+
+    ToneOptions options = argCheck(argc, argv);
+
+    // Before the kernel, which is an exact one in deterministic mode.
+    selectDeterministicMode(options.deterministic);
+    selectReinhardKernel(options.kernelISA);
+    selectTransferFunction(options.transfer);
+
+    if(options.stats != STATS_OFF)
+        enableToneStats();
+
+    StageTimer spawnStage;
+    spawnStage.begin("thread spawn");
+    ThreadPool pool(options.numThreads, options.tileRows);
+    if(options.pinThreads && !pool.pinWorkers())
+        std::cerr << "Warning: Could not pin the worker threads." << std::endl;
+    spawnStage.end();
+
+    // Allocations inside the stages throw; parallelFor() hands a worker's exception to this thread.
+    try {
+        toneMap(options, pool);
+    }
+    catch(const std::bad_alloc&){
+        std::cerr << "Error: Out of memory" << std::endl;
+        exit(1);
+    }
+
+    if(options.tileStats)
+        printTileTimings(pool.tileTimings());
+
+    if(options.statsCache)
+        printLuminanceCacheStats();
+
+    if(options.stats != STATS_OFF)
+        printToneStats(options.stats, pool.size());
+
+}
@@ -0,0 +1,324 @@
+#include <immintrin.h>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include "tone.h"
+#include "threadPool.h"
+
+// Tone curves other than the global Reinhard curve of toneMapReinhard(). Both work on the float
+// planes and end in the same per-pixel step, c * 255 * Ld / L, with s = key / avgLum and Ls = s L:
+//
+//   extended  Ld = Ls (1 + Ls / Lwhite^2) / (1 + Ls), so a scaled luminance of Lwhite maps to
+//             exactly 1 and anything brighter saturates to white.
+//   local     Ld = Ls / (1 + V), V = Gaussian-weighted average of Ls around the pixel over the largest
+//             scale in which the local contrast stays below LOCAL_THRESHOLD (Reinhard et al. 2002,
+//             dodge-and-burn).
+//
+// The local operator blurs Ls at LOCAL_SCALES + 1 scales with a separable Gaussian. Scale i + 1 of
+// the centre blur is scale i's surround blur, so each scale costs one blur, and only two blur
+// planes plus one scratch plane are alive at a time. Both blur passes run over row tiles on the
+// pool and use the widest of AVX2 and SSE4.1 the CPU supports, whatever --kernel selected. Every
+// version sums the taps in the same order with separate multiplies and adds, so they give the same
+// bits (and --deterministic output does not depend on the CPU).
+
+static const int LOCAL_SCALES = 8;
+static const float LOCAL_SCALE_RATIO = 1.6f;
+static const float LOCAL_ALPHA = 0.35f;         // centre Gaussian width at scale 1, in pixels
+static const float LOCAL_SHARPENING = 8.0f;     // phi
+static const float LOCAL_THRESHOLD = 0.05f;     // epsilon
+
+// Normalized Gaussian taps for weights[0 .. 2 * radius].
+static std::vector<float> gaussianWeights(float sigma, int& radius){
+    radius = std::max(1, (int)std::ceil(3.0f * sigma));
+    std::vector<float> weights(2 * radius + 1);
+
+    double sum = 0.0;
+    for(int k = -radius; k <= radius; k++){
+        weights[k + radius] = (float)std::exp(-(double)k * k / (2.0 * sigma * sigma));
+        sum += weights[k + radius];
+    }
+    for(float& weight : weights){
+        weight = (float)(weight / sum);
+    }
+    return weights;
+}
+
+// Horizontal pass over one row. padded holds the row with radius copies of the edge pixels on
+// both sides, so the loop needs no bounds checks.
+static void blurRowScalar(const float* padded, float* dst, int width, const float* weights, int taps){
+    for(int x = 0; x < width; x++){
+        float sum = 0.0f;
+        for(int k = 0; k < taps; k++){
+            sum += weights[k] * padded[x + k];
+        }
+        dst[x] = sum;
+    }
+}
+
+__attribute__((target("avx2")))
+static void blurRowAVX2(const float* padded, float* dst, int width, const float* weights, int taps){
+    int x = 0;
+    for(; x + 8 <= width; x += 8){
+        __m256 sum = _mm256_setzero_ps();
+        for(int k = 0; k < taps; k++){
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(weights[k]), _mm256_loadu_ps(padded + x + k)));
+        }
+        _mm256_storeu_ps(dst + x, sum);
+    }
+    blurRowScalar(padded + x, dst + x, width - x, weights, taps);
+}
+
+__attribute__((target("sse4.1")))
+static void blurRowSSE41(const float* padded, float* dst, int width, const float* weights, int taps){
+    int x = 0;
+    for(; x + 4 <= width; x += 4){
+        __m128 sum = _mm_setzero_ps();
+        for(int k = 0; k < taps; k++){
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(weights[k]), _mm_loadu_ps(padded + x + k)));
+        }
+        _mm_storeu_ps(dst + x, sum);
+    }
+    blurRowScalar(padded + x, dst + x, width - x, weights, taps);
+}
+
+// Vertical pass over one row: rows[k] points at source row y - radius + k, clamped to the image.
+static void blurColumnScalar(const float* const* rows, float* dst, int width, const float* weights, int taps){
+    for(int x = 0; x < width; x++){
+        float sum = 0.0f;
+        for(int k = 0; k < taps; k++){
+            sum += weights[k] * rows[k][x];
+        }
+        dst[x] = sum;
+    }
+}
+
+__attribute__((target("avx2")))
+static void blurColumnAVX2(const float* const* rows, float* dst, int width, const float* weights, int taps){
+    int x = 0;
+    for(; x + 8 <= width; x += 8){
+        __m256 sum = _mm256_setzero_ps();
+        for(int k = 0; k < taps; k++){
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(weights[k]), _mm256_loadu_ps(rows[k] + x)));
+        }
+        _mm256_storeu_ps(dst + x, sum);
+    }
+    for(; x < width; x++){
+        float sum = 0.0f;
+        for(int k = 0; k < taps; k++){
+            sum += weights[k] * rows[k][x];
+        }
+        dst[x] = sum;
+    }
+}
+
+__attribute__((target("sse4.1")))
+static void blurColumnSSE41(const float* const* rows, float* dst, int width, const float* weights, int taps){
+    int x = 0;
+    for(; x + 4 <= width; x += 4){
+        __m128 sum = _mm_setzero_ps();
+        for(int k = 0; k < taps; k++){
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(weights[k]), _mm_loadu_ps(rows[k] + x)));
+        }
+        _mm_storeu_ps(dst + x, sum);
+    }
+    for(; x < width; x++){
+        float sum = 0.0f;
+        for(int k = 0; k < taps; k++){
+            sum += weights[k] * rows[k][x];
+        }
+        dst[x] = sum;
+    }
+}
+
+typedef void (*BlurRowFunction)(const float* padded, float* dst, int width, const float* weights, int taps);
+typedef void (*BlurColumnFunction)(const float* const* rows, float* dst, int width, const float* weights, int taps);
+
+// Separable Gaussian blur of src into dst with clamp-to-edge borders; scratch holds the
+// horizontal pass. paddedRows has one buffer per pool worker.
+static void gaussianBlur(const float* src, float* dst, float* scratch, int width, int height, float sigma,
+                         std::vector<std::vector<float>>& paddedRows, ThreadPool& pool){
+    int radius;
+    std::vector<float> weights = gaussianWeights(sigma, radius);
+    int taps = 2 * radius + 1;
+    KernelISA isa = detectKernelISA();
+    BlurRowFunction blurRow = isa == ISA_AVX2 ? blurRowAVX2 : isa == ISA_SSE41 ? blurRowSSE41 : blurRowScalar;
+    BlurColumnFunction blurColumn = isa == ISA_AVX2 ? blurColumnAVX2
+                                  : isa == ISA_SSE41 ? blurColumnSSE41 : blurColumnScalar;
+
+    pool.parallelFor(pool.tileCount(height), [&](int tile, int worker){
+        std::vector<float>& padded = paddedRows[worker];
+        padded.resize(width + 2 * radius);
+
+        for(int y = pool.tileStart(tile); y < pool.tileEnd(tile, height); y++){
+            const float* row = src + (size_t)y * width;
+            std::fill(padded.begin(), padded.begin() + radius, row[0]);
+            std::copy(row, row + width, padded.begin() + radius);
+            std::fill(padded.begin() + radius + width, padded.end(), row[width - 1]);
+
+            blurRow(padded.data(), scratch + (size_t)y * width, width, weights.data(), taps);
+        }
+    });
+
+    pool.parallelFor(pool.tileCount(height), [&](int tile, int){
+        std::vector<const float*> rows(taps);
+
+        for(int y = pool.tileStart(tile); y < pool.tileEnd(tile, height); y++){
+            for(int k = 0; k < taps; k++){
+                int source = std::min(std::max(y - radius + k, 0), height - 1);
+                rows[k] = scratch + (size_t)source * width;
+            }
+            blurColumn(rows.data(), dst + (size_t)y * width, width, weights.data(), taps);
+        }
+    });
+}
+
+// Scales pixel i by gain = Ld / L. encode is outputEncodeLUT(): null for linear output, the sRGB
+// table otherwise. Linear bytes are rounded to nearest, so an Ld of 1 reaches 255 despite float
+// error; the encode table is built for truncated indices and the top one is already white.
+static inline RGB applyAdaptation(const PlanarImage& input, size_t i, float L, float gain, const int32_t* encode){
+    float maxOutput = encode ? SRGB_ENCODE_SIZE - 1 : 255.0f;
+    float factor = L < 1e-5f ? 0.0f : gain * maxOutput;
+    RGB out;
+    if(encode){
+        out.r = (uint8_t)encode[(int)std::min(input.r[i] * factor, maxOutput)];
+        out.g = (uint8_t)encode[(int)std::min(input.g[i] * factor, maxOutput)];
+        out.b = (uint8_t)encode[(int)std::min(input.b[i] * factor, maxOutput)];
+    }
+    else {
+        out.r = static_cast<uint8_t>(std::min(input.r[i] * factor + 0.5f, maxOutput));
+        out.g = static_cast<uint8_t>(std::min(input.g[i] * factor + 0.5f, maxOutput));
+        out.b = static_cast<uint8_t>(std::min(input.b[i] * factor + 0.5f, maxOutput));
+    }
+    return out;
+}
+
+static inline float planarLuminance(const PlanarImage& input, size_t i){
+    RGBf pixel = {input.r[i], input.g[i], input.b[i]};
+    return pixelLuminance(pixel);
+}
+
+// Largest scaled luminance of the image, the default white point of the extended operator.
+static float maxScaledLuminance(const PlanarImage& input, float scale, ThreadPool& pool){
+    int width = input.width;
+    int height = input.height;
+    std::vector<float> tileMax(pool.tileCount(height), 0.0f);
+
+    pool.parallelFor(tileMax.size(), [&](int tile, int){
+        float maxL = 0.0f;
+        for(size_t i = (size_t)pool.tileStart(tile) * width; i < (size_t)pool.tileEnd(tile, height) * width; i++){
+            maxL = std::max(maxL, planarLuminance(input, i));
+        }
+        tileMax[tile] = maxL;
+    });
+
+    return scale * *std::max_element(tileMax.begin(), tileMax.end());
+}
+
+void toneMapExtended(const PlanarImage& input, RGBBuffer& output, float avgLum, float exposureKey,
+                     float whitePoint, ThreadPool& pool){
+    int width = input.width;
+    int height = input.height;
+    float scale = exposureKey / avgLum;
+
+    if(whitePoint <= 0.0f)
+        whitePoint = maxScaledLuminance(input, scale, pool);
+    float inverseWhite2 = whitePoint > 0.0f ? 1.0f / (whitePoint * whitePoint) : 0.0f;
+
+    const int32_t* encode = outputEncodeLUT();
+    output.resize(input.size());
+    pool.parallelFor(pool.tileCount(height), [&](int tile, int){
+        for(size_t i = (size_t)pool.tileStart(tile) * width; i < (size_t)pool.tileEnd(tile, height) * width; i++){
+            float L = planarLuminance(input, i);
+            float Ls = scale * L;
+            output[i] = applyAdaptation(input, i, L, scale * (1.0f + Ls * inverseWhite2) / (1.0f + Ls), encode);
+        }
+    });
+}
+
+void toneMapLocal(const PlanarImage& input, RGBBuffer& output, float avgLum, float exposureKey,
+                  ThreadPool& pool){
+    int width = input.width;
+    int height = input.height;
+    size_t count = input.size();
+    float scale = exposureKey / avgLum;
+
+    // Every plane is first written tile by tile on the pool, so its pages land on the workers' nodes.
+    std::vector<float, FirstTouchAllocator<float>> scaled(count);
+    std::vector<float, FirstTouchAllocator<float>> centre(count);
+    std::vector<float, FirstTouchAllocator<float>> surround(count);
+    std::vector<float, FirstTouchAllocator<float>> scratch(count);
+    std::vector<float, FirstTouchAllocator<float>> adaptation(count);
+    std::vector<uint8_t, FirstTouchAllocator<uint8_t>> settled(count);
+    std::vector<std::vector<float>> paddedRows(pool.size());
+
+    pool.parallelFor(pool.tileCount(height), [&](int tile, int){
+        for(size_t i = (size_t)pool.tileStart(tile) * width; i < (size_t)pool.tileEnd(tile, height) * width; i++){
+            scaled[i] = scale * planarLuminance(input, i);
+            settled[i] = 0;
+        }
+    });
+
+    float s = 1.0f;
+    gaussianBlur(scaled.data(), centre.data(), scratch.data(), width, height, LOCAL_ALPHA * s / std::sqrt(2.0f),
+                 paddedRows, pool);
+
+    pool.parallelFor(pool.tileCount(height), [&](int tile, int){
+        size_t begin = (size_t)pool.tileStart(tile) * width;
+        size_t end = (size_t)pool.tileEnd(tile, height) * width;
+        std::copy(centre.begin() + begin, centre.begin() + end, adaptation.begin() + begin);
+    });
+
+    for(int scaleIndex = 0; scaleIndex < LOCAL_SCALES; scaleIndex++){
+        gaussianBlur(scaled.data(), surround.data(), scratch.data(), width, height,
+                     LOCAL_ALPHA * LOCAL_SCALE_RATIO * s / std::sqrt(2.0f), paddedRows, pool);
+
+        float bias = std::pow(2.0f, LOCAL_SHARPENING) * exposureKey / (s * s);
+
+        // A pixel keeps the centre average of the last scale before the contrast first exceeds the threshold.
+        pool.parallelFor(pool.tileCount(height), [&](int tile, int){
+            for(size_t i = (size_t)pool.tileStart(tile) * width; i < (size_t)pool.tileEnd(tile, height) * width; i++){
+                if(settled[i])
+                    continue;
+                float activity = (centre[i] - surround[i]) / (bias + centre[i]);
+                if(std::fabs(activity) < LOCAL_THRESHOLD)
+                    adaptation[i] = centre[i];
+                else
+                    settled[i] = 1;
+            }
+        });
+
+        centre.swap(surround);
+        s *= LOCAL_SCALE_RATIO;
+    }
+
+    const int32_t* encode = outputEncodeLUT();
+    output.resize(count);
+    pool.parallelFor(pool.tileCount(height), [&](int tile, int){
+        for(size_t i = (size_t)pool.tileStart(tile) * width; i < (size_t)pool.tileEnd(tile, height) * width; i++){
+            output[i] = applyAdaptation(input, i, planarLuminance(input, i), scale / (1.0f + adaptation[i]), encode);
+        }
+    });
+}
+
+// Maps the float planes with options.toneOperator; the global curve uses the selected Reinhard kernel.
+void toneMapPlanar(const ToneOptions& options, const PlanarImage& input, float avgLum, RGBBuffer& output,
+                   ThreadPool& pool){
+    int width = input.width;
+    int height = input.height;
+
+    switch(options.toneOperator){
+        case OPERATOR_EXTENDED:
+            toneMapExtended(input, output, avgLum, options.exposureKey, options.whitePoint, pool);
+            break;
+        case OPERATOR_LOCAL:
+            toneMapLocal(input, output, avgLum, options.exposureKey, pool);
+            break;
+        default:
+            output.resize(input.size());
+            pool.parallelFor(pool.tileCount(height), [&](int tile, int){
+                processChunk((size_t)pool.tileStart(tile) * width, (size_t)pool.tileEnd(tile, height) * width, input,
+                             output, avgLum, options.exposureKey);
+            });
+            break;
+    }
+}
@@ -0,0 +1,307 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <chrono>
+#include <cmath>
+#include <cctype>
+#include <algorithm>
+#include <filesystem>
+#include "tone.h"
+#include "threadPool.h"
+
+// Sequence mode (--sequence): a directory or manifest of frames is mapped as one clip, in order.
+//
+// Three stages run at once: a reader thread reads frame N+1 from disk as raw file bytes, the
+// calling thread decodes, averages, maps and encodes frame N with the whole pool, and a writer
+// thread writes frame N-1. All the per-pixel work is on the pool, so frame throughput scales with
+// it; the two I/O threads only move bytes. Frames travel between the stages in a fixed number of
+// slots, so memory stays at a few frames however long the sequence is.
+//
+// Each frame's log average (and automatic key) is smoothed in the log domain with an exponential
+// moving average whose time constant is --adapt frames, so a sudden change of scene brightness is
+// followed over a few frames instead of flickering. --adapt 0 maps every frame on its own average.
+
+namespace fs = std::filesystem;
+
+// Slots in flight between reader and mapper, and between mapper and writer.
+static const int SEQUENCE_INPUT_SLOTS = 2;
+static const int SEQUENCE_OUTPUT_SLOTS = 2;
+
+// A frame as read from disk: BMP frames keep the file's pixel array for the pool to decode, HDR
+// frames are decoded by the reader.
+struct InputFrame {
+    size_t index;
+    bool hdr;
+    BMPFileHeader bmpFile;
+    BMPInfoHeader bmpInfo;
+    BMPFormat format;
+    std::vector<uint8_t> filePixels;
+    PlanarImage hdrPixels;
+};
+
+// A mapped frame as the padded BGR pixel array of its output file. BMP frames keep their source
+// headers (resolution and so on), like a single mapped image; HDR frames get fresh ones.
+struct OutputFrame {
+    size_t index;
+    BMPFileHeader bmpFile;
+    BMPInfoHeader bmpInfo;
+    BMPPixelArray pixelArray;
+};
+
+// Unbounded blocking queue; the slots circulating through it are what bounds memory.
+template <typename T>
+class FrameQueue {
+public:
+    void push(T item){
+        std::lock_guard<std::mutex> lock(mutex);
+        items.push_back(std::move(item));
+        ready.notify_one();
+    }
+
+    T pop(){
+        std::unique_lock<std::mutex> lock(mutex);
+        ready.wait(lock, [&]{ return !items.empty(); });
+        T item = std::move(items.front());
+        items.pop_front();
+        return item;
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<T> items;
+};
+
+// Natural order, so frame_9.bmp comes before frame_10.bmp when the numbers are not zero-padded.
+static bool frameOrder(const std::string& a, const std::string& b){
+    size_t i = 0, j = 0;
+    while(i < a.size() && j < b.size()){
+        if(isdigit((unsigned char)a[i]) && isdigit((unsigned char)b[j])){
+            size_t endA = i, endB = j;
+            while(endA < a.size() && isdigit((unsigned char)a[endA])) endA++;
+            while(endB < b.size() && isdigit((unsigned char)b[endB])) endB++;
+
+            // Compare the numbers without leading zeros by length, then digit by digit.
+            size_t startA = i, startB = j;
+            while(startA + 1 < endA && a[startA] == '0') startA++;
+            while(startB + 1 < endB && b[startB] == '0') startB++;
+            if(endA - startA != endB - startB)
+                return endA - startA < endB - startB;
+            int order = a.compare(startA, endA - startA, b, startB, endB - startB);
+            if(order != 0)
+                return order < 0;
+
+            i = endA;
+            j = endB;
+        }
+        else {
+            if(a[i] != b[j])
+                return a[i] < b[j];
+            i++;
+            j++;
+        }
+    }
+    return a.size() - i < b.size() - j;
+}
+
+// Runs on the reader thread. BMP frames only get their pixel array read, HDR frames are decoded
+// here through a 0-thread pool.
+static void readFrame(const std::string& path, InputFrame& frame, ThreadPool& serialPool){
+    frame.hdr = isHDRPath(path.c_str());
+    if(frame.hdr){
+        readHDR(path.c_str(), frame.hdrPixels, serialPool);
+        return;
+    }
+
+    std::ifstream readBMP(path, std::ios::binary);
+    if(!readBMP){
+        std::cerr << "Error: Cannot open file " << path << std::endl;
+        exit(1);
+    }
+
+    readBMPHeaders(readBMP, frame.bmpFile, frame.bmpInfo);
+    frame.format = readBMPFormat(readBMP, frame.bmpInfo);
+
+    const BMPFormat& format = frame.format;
+    frame.filePixels.resize(format.srcStride * format.height);
+
+    readBMP.clear();
+    readBMP.seekg(frame.bmpFile.dataOffset, std::ios::beg);
+    readBMP.read(reinterpret_cast<char*>(frame.filePixels.data()), frame.filePixels.size());
+    if((size_t)readBMP.gcount() < (format.height - 1) * format.srcStride + (size_t)format.width * format.bytesPerPixel){
+        std::cerr << "Error: Unexpected end of pixel data" << std::endl;
+        exit(1);
+    }
+}
+
+// Decodes a BMP frame's file rows into the float planes, one tile of file rows per task.
+static void decodeFrame(const InputFrame& frame, PlanarImage& pixels, ThreadPool& pool){
+    const BMPFormat& format = frame.format;
+    int height = format.height;
+    pixels.resize(format.width, height, &pool);
+
+    pool.parallelFor(pool.tileCount(height), [&](int tile, int){
+        int start = pool.tileStart(tile);
+        int end = pool.tileEnd(tile, height);
+        int firstRow = format.topDown ? height - end : start;
+        decodeBMPRows(format, frame.filePixels.data() + start * format.srcStride, end - start, pixels, firstRow);
+    });
+}
+
+// Runs on the writer thread.
+static void writeFrame(const std::string& path, const OutputFrame& frame){
+    std::ofstream writeBMP(path, std::ios::binary);
+    if(!writeBMP){
+        std::cerr << "Error: Cannot open file " << path << std::endl;
+        exit(1);
+    }
+
+    writeBMPPixelArray(writeBMP, frame.bmpFile, frame.bmpInfo, frame.pixelArray);
+    if(!writeBMP){
+        std::cerr << "Error: Cannot write output file " << path << std::endl;
+        exit(1);
+    }
+}
+
+void toneMapSequence(const ToneOptions& options, ThreadPool& pool){
+    auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::string> sources = collectSources(options.srcPath);
+    if(sources.empty()){
+        std::cerr << "Error: No bmp, pfm or hdr files found in " << options.srcPath << std::endl;
+        exit(1);
+    }
+    // A manifest is already in frame order.
+    if(fs::is_directory(options.srcPath))
+        std::sort(sources.begin(), sources.end(), frameOrder);
+
+    fs::path targetDir(options.targetPath);
+    std::error_code ec;
+    fs::create_directories(targetDir, ec);
+    if(!fs::is_directory(targetDir)){
+        std::cerr << "Error: Could not create directory " << options.targetPath << std::endl;
+        exit(1);
+    }
+
+    std::vector<std::string> targets = batchTargets(sources, options.targetPath);
+
+    // Weight of the newest frame in the moving average.
+    double adaptRate = options.adaptFrames > 0.0f ? 1.0 - std::exp(-1.0 / options.adaptFrames) : 1.0;
+
+    FrameQueue<std::unique_ptr<InputFrame>> freeInputs, readInputs;
+    FrameQueue<std::unique_ptr<OutputFrame>> freeOutputs, mappedOutputs;
+    for(int i = 0; i < SEQUENCE_INPUT_SLOTS; i++){
+        freeInputs.push(std::unique_ptr<InputFrame>(new InputFrame()));
+    }
+    for(int i = 0; i < SEQUENCE_OUTPUT_SLOTS; i++){
+        freeOutputs.push(std::unique_ptr<OutputFrame>(new OutputFrame()));
+    }
+
+    // A null slot ends the sequence. An exception on either side (bad_alloc from a decode or from
+    // parallelFor()) ends it early: both threads still get their null slot and are joined before it
+    // is rethrown, so it reaches toneMain instead of std::terminate.
+    std::exception_ptr readerError, mapperError;
+    std::atomic<bool> stopping(false);
+
+    std::thread reader([&]{
+        try {
+            ThreadPool serialPool(0);
+            for(size_t i = 0; i < sources.size() && !stopping; i++){
+                std::unique_ptr<InputFrame> frame = freeInputs.pop();
+                frame->index = i;
+                readFrame(sources[i], *frame, serialPool);
+                readInputs.push(std::move(frame));
+            }
+        }
+        catch(...){
+            readerError = std::current_exception();
+        }
+        readInputs.push(nullptr);
+    });
+
+    std::thread writer([&]{
+        while(std::unique_ptr<OutputFrame> frame = mappedOutputs.pop()){
+            writeFrame(targets[frame->index], *frame);
+            freeOutputs.push(std::move(frame));
+        }
+    });
+
+    ToneOptions frameOptions = options;
+    frameOptions.luminanceCache = nullptr;
+
+    PlanarImage decoded;
+    RGBBuffer mappedPixels;
+    double adaptedLogAverage = 0.0;
+    double adaptedLogKey = 0.0;
+
+    try {
+        while(std::unique_ptr<InputFrame> input = readInputs.pop()){
+            if(!input->hdr)
+                decodeFrame(*input, decoded, pool);
+            const PlanarImage& pixels = input->hdr ? input->hdrPixels : decoded;
+
+            float exposureKey;
+            float logAvgLuminance = planarLogAverage(frameOptions, pixels, pool, exposureKey);
+
+            if(input->index == 0){
+                adaptedLogAverage = std::log((double)logAvgLuminance);
+                adaptedLogKey = std::log((double)exposureKey);
+            }
+            else {
+                adaptedLogAverage += adaptRate * (std::log((double)logAvgLuminance) - adaptedLogAverage);
+                adaptedLogKey += adaptRate * (std::log((double)exposureKey) - adaptedLogKey);
+            }
+
+            ToneOptions mapOptions = frameOptions;
+            mapOptions.exposureKey = (float)std::exp(adaptedLogKey);
+            float adaptedLuminance = (float)std::exp(adaptedLogAverage);
+            toneMapPlanar(mapOptions, pixels, adaptedLuminance, mappedPixels, pool);
+
+            std::unique_ptr<OutputFrame> output = freeOutputs.pop();
+            output->index = input->index;
+            if(input->hdr){
+                makeBMPHeaders(pixels.width, pixels.height, output->bmpFile, output->bmpInfo);
+            }
+            else {
+                output->bmpFile = input->bmpFile;
+                output->bmpInfo = input->bmpInfo;
+            }
+            encodeBMPPixelArray(mappedPixels, pixels.width, pixels.height, output->pixelArray, pool);
+
+            std::cout << sources[input->index] << " -> " << targets[input->index] << " (" << logAvgLuminance
+                      << ", adapted " << adaptedLuminance << ", key " << mapOptions.exposureKey << ")" << std::endl;
+
+            mappedOutputs.push(std::move(output));
+            freeInputs.push(std::move(input));
+        }
+    }
+    catch(...){
+        mapperError = std::current_exception();
+        stopping = true;
+        // Hands the reader back its slots until it ends, so it is never left waiting for one.
+        while(std::unique_ptr<InputFrame> input = readInputs.pop()){
+            freeInputs.push(std::move(input));
+        }
+    }
+
+    mappedOutputs.push(nullptr);
+    reader.join();
+    writer.join();
+
+    if(mapperError)
+        std::rethrow_exception(mapperError);
+    if(readerError)
+        std::rethrow_exception(readerError);
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << sources.size() << " frames tone mapped in " << elapsed.count() << " s ("
+              << sources.size() / elapsed.count() << " frames/s)." << std::endl;
+}
@@ -0,0 +1,166 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <algorithm>
+#include "tone.h"
+#include "threadPool.h"
+
+// Per-stage instrumentation (--stats text|json). Each StageTimer stage records wall time, process
+// CPU time (all threads), bytes read and written, pixels processed and, for stages that run on the
+// pool, the tile time of every worker. The imbalance of a stage is its busiest worker's time over
+// the mean, so 1.00 means the pool was evenly loaded.
+//
+// Nothing is recorded unless enableToneStats() was called: StageTimer::begin() tests
+// activeToneStats and the other members test the stage's open flag.
+
+struct ToneStats {
+    std::vector<StageRecord> stages;
+    double wallStart;
+    double cpuStart;
+};
+
+ToneStats* activeToneStats = nullptr;
+
+static double wallNow(){
+    std::chrono::duration<double> now = std::chrono::steady_clock::now().time_since_epoch();
+    return now.count();
+}
+
+static double cpuNow(){
+    timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+void enableToneStats(){
+    static ToneStats stats;
+    stats.wallStart = wallNow();
+    stats.cpuStart = cpuNow();
+    activeToneStats = &stats;
+}
+
+void StageTimer::beginStage(const char* name){
+    end();
+
+    record = StageRecord();
+    record.name = name;
+    if(pool != nullptr)
+        workerStart = pool->workerSeconds();
+    open = true;
+    cpuStart = cpuNow();
+    wallStart = wallNow();
+}
+
+void StageTimer::endStage(){
+    record.wallSeconds = wallNow() - wallStart;
+    record.cpuSeconds = cpuNow() - cpuStart;
+    open = false;
+
+    // Serial stages leave every worker's tile time unchanged.
+    if(pool != nullptr){
+        std::vector<double> workerEnd = pool->workerSeconds();
+        bool ranTiles = false;
+        for(size_t i = 0; i < workerEnd.size(); i++){
+            record.workerSeconds.push_back(workerEnd[i] - workerStart[i]);
+            ranTiles = ranTiles || record.workerSeconds[i] > 0.0;
+        }
+        if(!ranTiles)
+            record.workerSeconds.clear();
+    }
+
+    activeToneStats->stages.push_back(record);
+}
+
+// Busiest worker over the mean worker, 0 for serial stages.
+static double imbalance(const StageRecord& stage){
+    if(stage.workerSeconds.empty())
+        return 0.0;
+    double total = 0.0;
+    double busiest = 0.0;
+    for(double seconds : stage.workerSeconds){
+        total += seconds;
+        busiest = std::max(busiest, seconds);
+    }
+    return total > 0.0 ? busiest * stage.workerSeconds.size() / total : 0.0;
+}
+
+static void printTextStats(const ToneStats& stats, double wall, double cpu, int threads){
+    char line[256];
+    uint64_t bytesRead = 0, bytesWritten = 0;
+
+    snprintf(line, sizeof(line), "%-16s %10s %10s %8s %10s %10s %10s %9s", "Stage", "wall ms", "cpu ms", "cpu/wall",
+             "MB read", "MB written", "Mpixels/s", "imbalance");
+    std::cout << line << std::endl;
+
+    for(const auto& stage : stats.stages){
+        double rate = stage.wallSeconds > 0.0 ? stage.pixels / stage.wallSeconds / 1e6 : 0.0;
+        double parallelism = stage.wallSeconds > 0.0 ? stage.cpuSeconds / stage.wallSeconds : 0.0;
+        snprintf(line, sizeof(line), "%-16s %10.3f %10.3f %8.2f %10.2f %10.2f %10.1f %9.2f", stage.name.c_str(),
+                 stage.wallSeconds * 1e3, stage.cpuSeconds * 1e3, parallelism, stage.bytesRead / 1e6,
+                 stage.bytesWritten / 1e6, rate, imbalance(stage));
+        std::cout << line << std::endl;
+
+        if(stage.workerSeconds.size() > 1){
+            std::cout << "  worker ms:";
+            for(double seconds : stage.workerSeconds){
+                snprintf(line, sizeof(line), " %.3f", seconds * 1e3);
+                std::cout << line;
+            }
+            std::cout << std::endl;
+        }
+
+        bytesRead += stage.bytesRead;
+        bytesWritten += stage.bytesWritten;
+    }
+
+    snprintf(line, sizeof(line), "Total: wall %.3f ms, cpu %.3f ms, %.2f MB read, %.2f MB written, %d threads",
+             wall * 1e3, cpu * 1e3, bytesRead / 1e6, bytesWritten / 1e6, threads);
+    std::cout << line << std::endl;
+}
+
+static void printJSONStats(const ToneStats& stats, double wall, double cpu, int threads){
+    char line[512];
+    uint64_t bytesRead = 0, bytesWritten = 0;
+
+    std::cout << "{\"threads\": " << threads << ", \"stages\": [" << std::endl;
+    for(size_t i = 0; i < stats.stages.size(); i++){
+        const StageRecord& stage = stats.stages[i];
+        double rate = stage.wallSeconds > 0.0 ? stage.pixels / stage.wallSeconds : 0.0;
+        snprintf(line, sizeof(line),
+                 "  {\"name\": \"%s\", \"wall_s\": %.6f, \"cpu_s\": %.6f, \"bytes_read\": %llu, "
+                 "\"bytes_written\": %llu, \"pixels\": %llu, \"pixels_per_s\": %.0f, \"imbalance\": %.3f, "
+                 "\"worker_s\": [",
+                 stage.name.c_str(), stage.wallSeconds, stage.cpuSeconds, (unsigned long long)stage.bytesRead,
+                 (unsigned long long)stage.bytesWritten, (unsigned long long)stage.pixels, rate, imbalance(stage));
+        std::cout << line;
+
+        for(size_t w = 0; w < stage.workerSeconds.size(); w++){
+            snprintf(line, sizeof(line), "%s%.6f", w ? ", " : "", stage.workerSeconds[w]);
+            std::cout << line;
+        }
+        std::cout << "]}" << (i + 1 < stats.stages.size() ? "," : "") << std::endl;
+
+        bytesRead += stage.bytesRead;
+        bytesWritten += stage.bytesWritten;
+    }
+
+    snprintf(line, sizeof(line), "], \"wall_s\": %.6f, \"cpu_s\": %.6f, \"bytes_read\": %llu, \"bytes_written\": %llu}",
+             wall, cpu, (unsigned long long)bytesRead, (unsigned long long)bytesWritten);
+    std::cout << line << std::endl;
+}
+
+void printToneStats(StatsFormat format, int threads){
+    if(activeToneStats == nullptr)
+        return;
+
+    double wall = wallNow() - activeToneStats->wallStart;
+    double cpu = cpuNow() - activeToneStats->cpuStart;
+
+    if(format == STATS_JSON)
+        printJSONStats(*activeToneStats, wall, cpu, threads);
+    else
+        printTextStats(*activeToneStats, wall, cpu, threads);
+}
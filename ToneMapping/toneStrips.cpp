@@ -0,0 +1,187 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include "tone.h"
+#include "threadPool.h"
+
+// Bounded-memory two-pass mode (--stream MB). Pass 1 reads the pixel array strip by strip and
+// only keeps the per-tile luminance sums (or the LUT histogram), pass 2 reads the strips again,
+// maps them and appends them to the output. Only one input and one output strip are alive at a
+// time, so memory does not grow with the image.
+//
+// Strips hold a whole number of pool tiles, so every tile covers the same rows as in the in-memory
+// paths and the log average comes out bit-identical to logAverageLuminanceRows(). That also makes
+// the float slot of the --stats-cache sidecar interchangeable with the in-memory paths.
+
+// Rows per strip for a budget covering one input and one output strip, at least one tile. Files in
+// another format need one more strip of file rows, which the budget does not count.
+static int stripRowsFor(size_t budgetBytes, size_t rowStride, int height, int tileRows){
+    size_t rows = budgetBytes / (2 * rowStride);
+    rows = std::max<size_t>(tileRows, rows - rows % tileRows);
+    return (int)std::min<size_t>(rows, height);
+}
+
+// Reads image rows [startRow, endRow) into strip as 24-bit bottom-up rows, converting through
+// fileRows if the file is in another format. The last row of the file may be missing its padding.
+static void readStrip(std::istream& readBMP, const BMPFileHeader& bmpFile, const BMPFormat& format,
+                      int startRow, int endRow, std::vector<uint8_t>& fileRows, std::vector<uint8_t>& strip){
+    int rows = endRow - startRow;
+    size_t srcStride = format.srcStride;
+    size_t bytes = rows * srcStride;
+    uint8_t* buffer = format.canonical() ? strip.data() : fileRows.data();
+
+    readBMP.clear();
+    readBMP.seekg(bmpFile.dataOffset + firstFileRow(format, startRow, endRow) * srcStride, std::ios::beg);
+    readBMP.read(reinterpret_cast<char*>(buffer), bytes);
+    if((size_t)readBMP.gcount() < bytes - srcStride + (size_t)format.width * format.bytesPerPixel){
+        std::cerr << "Error: Unexpected end of pixel data" << std::endl;
+        exit(1);
+    }
+
+    if(!format.canonical())
+        convertBMPRows(format, fileRows.data(), rows, strip.data(), bmpRowStride(format.width));
+}
+
+float toneMapStrips(const ToneOptions& options, ThreadPool& pool){
+
+    std::ifstream readBMP(options.srcPath, std::ios::binary);
+    if(!readBMP){
+        std::cerr << "Error: Cannot open file " << options.srcPath << std::endl;
+        exit(1);
+    }
+
+    BMPFileHeader bmpFile;
+    BMPInfoHeader bmpInfo;
+    StageTimer stage(&pool);
+    stage.begin("header parse");
+    readBMPHeaders(readBMP, bmpFile, bmpInfo);
+    BMPFormat format = readBMPFormat(readBMP, bmpInfo);
+    stage.count(bmpFile.dataOffset, 0, 0);
+
+    int width = format.width;
+    int height = format.height;
+    size_t rowStride = bmpRowStride(width);
+    int stripRows = stripRowsFor(options.streamBytes, rowStride, height, pool.tileRows());
+    int tilesPerStrip = pool.tileCount(stripRows);
+
+    std::vector<uint8_t> inputStrip(stripRows * rowStride);
+    std::vector<uint8_t> fileRows(format.canonical() ? 0 : stripRows * format.srcStride);
+
+    // Pass 1: luminance only, skipped when --stats-cache already knows the log average. An automatic
+    // key is chosen from the LUT histogram or from per-worker exposure histograms filled in passing.
+    bool autoExposure = options.exposureKey == 0.0f;
+    float exposureKey = options.exposureKey;
+
+    auto luminancePass = [&]{
+        std::vector<double> tileSums(pool.tileCount(height), 0.0);
+        std::vector<std::vector<uint32_t>> histograms;
+        if(options.useLUT)
+            histograms.assign(pool.size(), std::vector<uint32_t>(LUT_LUMINANCE_SIZE, 0));
+        else if(autoExposure)
+            histograms.assign(pool.size(), std::vector<uint32_t>(EXPOSURE_HISTOGRAM_BINS, 0));
+
+        for(int stripStart = 0, strip = 0; stripStart < height; stripStart += stripRows, strip++){
+            int rows = std::min(stripRows, height - stripStart);
+            readStrip(readBMP, bmpFile, format, stripStart, stripStart + rows, fileRows, inputStrip);
+
+            pool.parallelFor(pool.tileCount(rows), [&](int tile, int worker){
+                int startRow = pool.tileStart(tile);
+                int endRow = pool.tileEnd(tile, rows);
+                if(options.useLUT)
+                    luminanceHistogramRows(startRow, endRow, width, inputStrip.data(), rowStride, histograms[worker]);
+                else
+                    luminanceRows(startRow, endRow, width, inputStrip.data(), rowStride,
+                                  tileSums[strip * tilesPerStrip + tile],
+                                  autoExposure ? histograms[worker].data() : nullptr);
+            });
+        }
+
+        if(options.useLUT){
+            std::vector<uint64_t> histogram(LUT_LUMINANCE_SIZE, 0);
+            for(const auto& workerHistogram : histograms){
+                for(int q = 0; q < LUT_LUMINANCE_SIZE; q++){
+                    histogram[q] += workerHistogram[q];
+                }
+            }
+            float logAverage = logAverageFromHistogram(histogram, (size_t)width * height);
+            if(autoExposure)
+                exposureKey = autoExposureKeyLUT(logAverage, histogram);
+            return logAverage;
+        }
+
+        double logSum = 0.0;
+        for(double tileSum : tileSums){
+            logSum += tileSum;
+        }
+        float logAverage = logAverageFromSum(logSum, (size_t)width * height);
+        if(autoExposure){
+            std::vector<uint64_t> histogram;
+            mergeExposureHistograms(histograms, histogram);
+            exposureKey = autoExposureKey(logAverage, histogram);
+        }
+        return logAverage;
+    };
+
+    size_t totalPixels = (size_t)width * height;
+    size_t pixelBytes = format.srcStride * height;
+
+    stage.begin("luminance pass");
+    bool cached = true;
+    float logAvgLuminance = cachedLogAverage(options.luminanceCache,
+                                             options.useLUT ? LUMINANCE_SLOT_LUT : LUMINANCE_SLOT_FLOAT, [&]{
+        cached = false;
+        return luminancePass();
+    }, autoExposure ? &exposureKey : nullptr);
+    if(!cached)
+        stage.count(pixelBytes, 0, totalPixels);
+
+    std::vector<uint32_t> table;
+    if(options.useLUT)
+        buildReinhardLUT(logAvgLuminance, exposureKey, table);
+
+    // Pass 2: map and append. The row padding of outputStrip is never written, so it stays zero.
+    stage.begin("map pass");
+    std::ofstream writeBMP(options.targetPath, std::ios::binary);
+    if(!writeBMP){
+        std::cerr << "Error: Cannot open file " << options.targetPath << std::endl;
+        exit(1);
+    }
+
+    BMPFileHeader outFile = bmpFile;
+    outFile.dataOffset = BMP_HEADER_SIZE;
+    outFile.fileSize = BMP_HEADER_SIZE + rowStride * height;
+
+    uint8_t headers[BMP_HEADER_SIZE];
+    serializeBMPHeaders(headers, outFile, outputInfoHeader(bmpInfo));
+    writeBMP.write(reinterpret_cast<const char*>(headers), BMP_HEADER_SIZE);
+
+    std::vector<uint8_t> outputStrip(stripRows * rowStride, 0);
+
+    for(int stripStart = 0; stripStart < height; stripStart += stripRows){
+        int rows = std::min(stripRows, height - stripStart);
+        readStrip(readBMP, bmpFile, format, stripStart, stripStart + rows, fileRows, inputStrip);
+
+        pool.parallelFor(pool.tileCount(rows), [&](int tile, int){
+            int startRow = pool.tileStart(tile);
+            int endRow = pool.tileEnd(tile, rows);
+            if(options.useLUT)
+                lutMapRows(startRow, endRow, width, inputStrip.data(), rowStride, outputStrip.data(), rowStride,
+                           table.data());
+            else
+                processRows(startRow, endRow, width, inputStrip.data(), rowStride, outputStrip.data(), rowStride,
+                            logAvgLuminance, exposureKey);
+        });
+
+        writeBMP.write(reinterpret_cast<const char*>(outputStrip.data()), rows * rowStride);
+    }
+
+    if(!writeBMP){
+        std::cerr << "Error: Cannot write output file" << std::endl;
+        exit(1);
+    }
+    stage.count(pixelBytes, outFile.fileSize, totalPixels);
+
+    return logAvgLuminance;
+}
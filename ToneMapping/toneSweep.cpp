@@ -0,0 +1,91 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include "tone.h"
+#include "threadPool.h"
+
+// Exposure sweep (--sweep k1,k2,...): the source is decoded and its log average computed once,
+// then every key is mapped from the same read-only float planes into its own output file.
+// With at least as many keys as workers each key is one pool task mapped through a 0-thread
+// pool (like the small images of batch mode); otherwise the keys take turns using the whole pool.
+
+// "out.bmp" + "0.18" -> "out_0.18.bmp"
+static std::string sweepTargetPath(const std::string& target, const std::string& key){
+    return target.substr(0, target.size() - 4) + "_" + key + ".bmp";
+}
+
+static void decodeSource(const char* path, bool usePread, PlanarImage& pixels, ThreadPool& pool){
+    if(isHDRPath(path)){
+        readHDR(path, pixels, pool);
+        return;
+    }
+
+    std::ifstream readBMP(path, std::ios::binary);
+    if(!readBMP){
+        std::cerr << "Error: Cannot open file " << path << std::endl;
+        exit(1);
+    }
+
+    BMPFileHeader bmpFile;
+    BMPInfoHeader bmpInfo;
+    readBMPHeaders(readBMP, bmpFile, bmpInfo);
+    BMPFormat format = readBMPFormat(readBMP, bmpInfo);
+    if(usePread)
+        preadBMPPixels(path, bmpFile, format, pixels, pool);
+    else
+        decodeBMPPixels(readBMP, bmpFile, format, pixels, &pool);
+}
+
+void toneMapSweep(const ToneOptions& options, ThreadPool& pool){
+    PlanarImage pixels;
+    decodeSource(options.srcPath, options.usePread, pixels, pool);
+
+    LuminanceCacheEntry luminanceCache;
+    if(options.statsCache)
+        loadLuminanceCache(options.srcPath, luminanceCache);
+
+    float logAvgLuminance = cachedLogAverage(options.statsCache ? &luminanceCache : nullptr, LUMINANCE_SLOT_FLOAT, [&]{
+        return logAverageLuminance(pixels, pool);
+    });
+
+    if(options.statsCache)
+        storeLuminanceCache(options.srcPath, luminanceCache);
+
+    std::cout << logAvgLuminance << std::endl;
+
+    int numKeys = options.sweepKeys.size();
+    std::mutex printMutex;
+
+    auto mapKey = [&](int index, ThreadPool& keyPool){
+        ToneOptions keyOptions = options;
+        keyOptions.exposureKey = std::stof(options.sweepKeys[index]);
+        std::string targetPath = sweepTargetPath(options.targetPath, options.sweepKeys[index]);
+
+        RGBBuffer outputPixels;
+        toneMapPlanar(keyOptions, pixels, logAvgLuminance, outputPixels, keyPool);
+        writeBMPImage(targetPath.c_str(), outputPixels, pixels.width, pixels.height, keyPool);
+
+        std::lock_guard<std::mutex> lock(printMutex);
+        std::cout << targetPath << " (key " << keyOptions.exposureKey << ")" << std::endl;
+    };
+
+    if(numKeys >= pool.size()){
+        std::vector<std::unique_ptr<ThreadPool>> serialPools;
+        for(int i = 0; i < pool.size(); i++){
+            serialPools.push_back(std::unique_ptr<ThreadPool>(new ThreadPool(0, options.tileRows)));
+        }
+        pool.parallelFor(numKeys, [&](int index, int worker){
+            mapKey(index, *serialPools[worker]);
+        });
+    }
+    else {
+        for(int i = 0; i < numKeys; i++){
+            mapKey(i, pool);
+        }
+    }
+
+    std::cout << numKeys << " exposures tone mapped successfully." << std::endl;
+}
@@ -0,0 +1,182 @@
+#include <new>
+#include <cfloat>
+#include <cstring>
+#include <system_error>
+#include <algorithm>
+#include "tonemap.h"
+#include "tone.h"
+#include "threadPool.h"
+
+// libtonemap entry points (see tonemap.h). Input rows are decoded into the context's float planes
+// tile by tile, then go through the same planarLogAverage() and toneMapPlanar() as a BMP file and
+// are encoded straight into the caller's rows. With useLUT the BGR8 rows are mapped in place by
+// toneMapLUT(), without the planes.
+//
+// None of the functions used here exit(); allocation failures surface as std::bad_alloc (or a
+// false tryResize()) and are turned into status codes. A bad_alloc thrown on a worker thread is
+// rethrown here by parallelFor().
+
+struct TonemapContext {
+    explicit TonemapContext(int numThreads) : pool(numThreads) {}
+
+    ThreadPool pool;
+    PlanarImage planes;
+    RGBBuffer mapped;
+};
+
+void tonemapDefaultParams(TonemapParams* params){
+    params->exposureKey = 0.18f;
+    params->toneOperator = TONEMAP_OPERATOR_GLOBAL;
+    params->whitePoint = 0.0f;
+    params->useLUT = 0;
+}
+
+TonemapStatus tonemapCreate(int numThreads, TonemapContext** context){
+    if(context == nullptr || numThreads < 0)
+        return TONEMAP_INVALID_ARGUMENT;
+    *context = nullptr;
+
+    try {
+        *context = new TonemapContext(numThreads);
+    }
+    catch(const std::bad_alloc&){
+        return TONEMAP_OUT_OF_MEMORY;
+    }
+    catch(const std::system_error&){
+        return TONEMAP_SYSTEM_ERROR;
+    }
+
+    return TONEMAP_OK;
+}
+
+void tonemapDestroy(TonemapContext* context){
+    delete context;
+}
+
+static TonemapStatus checkArguments(const TonemapImage* input, const TonemapParams* params, const uint8_t* output,
+                                    size_t outputStride){
+    if(input == nullptr || params == nullptr || output == nullptr || input->data == nullptr)
+        return TONEMAP_INVALID_ARGUMENT;
+    if(input->width <= 0 || input->height <= 0)
+        return TONEMAP_INVALID_ARGUMENT;
+
+    size_t pixelBytes;
+    switch(input->format){
+        case TONEMAP_FORMAT_BGR8:   pixelBytes = 3; break;
+        case TONEMAP_FORMAT_RGB32F: pixelBytes = 3 * sizeof(float); break;
+        default:                    return TONEMAP_INVALID_ARGUMENT;
+    }
+    if(input->stride < pixelBytes * input->width || outputStride < 3 * (size_t)input->width)
+        return TONEMAP_INVALID_ARGUMENT;
+
+    if(!(params->exposureKey >= 0.0f) || !(params->whitePoint >= 0.0f))
+        return TONEMAP_INVALID_ARGUMENT;
+    if(params->toneOperator != TONEMAP_OPERATOR_GLOBAL && params->toneOperator != TONEMAP_OPERATOR_EXTENDED
+       && params->toneOperator != TONEMAP_OPERATOR_LOCAL)
+        return TONEMAP_INVALID_ARGUMENT;
+
+    if(params->useLUT && (input->format != TONEMAP_FORMAT_BGR8 || params->toneOperator != TONEMAP_OPERATOR_GLOBAL))
+        return TONEMAP_UNSUPPORTED;
+    return TONEMAP_OK;
+}
+
+// Negative and NaN samples become 0 and infinities the largest float, as in toneHDR.cpp.
+static inline float sanitize(float value){
+    return value > 0.0f ? std::min(value, FLT_MAX) : 0.0f;
+}
+
+// Input rows [startRow, endRow) into the float planes, normalized like a BMP (BGR8) or sanitized
+// (RGB32F).
+static void decodeInputRows(const TonemapImage& input, int startRow, int endRow, PlanarImage& planes){
+    const uint8_t* base = static_cast<const uint8_t*>(input.data);
+    const float* normalize = normalizationLUT();
+
+    for(int i = startRow; i < endRow; i++){
+        const uint8_t* row = base + (size_t)i * input.stride;
+        size_t out = (size_t)i * input.width;
+
+        if(input.format == TONEMAP_FORMAT_BGR8){
+            for(int j = 0; j < input.width; j++){
+                planes.b[out + j] = normalize[row[j * 3 + 0]];
+                planes.g[out + j] = normalize[row[j * 3 + 1]];
+                planes.r[out + j] = normalize[row[j * 3 + 2]];
+            }
+        }
+        else {
+            // The caller's stride need not keep rows float-aligned, so the samples are copied out.
+            for(int j = 0; j < input.width; j++){
+                float pixel[3];
+                memcpy(pixel, row + (size_t)j * sizeof(pixel), sizeof(pixel));
+                planes.r[out + j] = sanitize(pixel[0]);
+                planes.g[out + j] = sanitize(pixel[1]);
+                planes.b[out + j] = sanitize(pixel[2]);
+            }
+        }
+    }
+}
+
+static float mapPlanar(TonemapContext& context, const TonemapImage& input, const TonemapParams& params,
+                       uint8_t* output, size_t outputStride){
+    ThreadPool& pool = context.pool;
+    int width = input.width;
+    int height = input.height;
+
+    if(!context.planes.tryResize(width, height, &pool))
+        throw std::bad_alloc();
+
+    pool.parallelFor(pool.tileCount(height), [&](int tile, int){
+        decodeInputRows(input, pool.tileStart(tile), pool.tileEnd(tile, height), context.planes);
+    });
+
+    ToneOptions options = ToneOptions();
+    options.exposureKey = params.exposureKey;
+    options.toneOperator = (ToneOperator)params.toneOperator;
+    options.whitePoint = params.whitePoint;
+
+    ToneOptions mapOptions = options;
+    float logAvgLuminance = planarLogAverage(options, context.planes, pool, mapOptions.exposureKey);
+    toneMapPlanar(mapOptions, context.planes, logAvgLuminance, context.mapped, pool);
+
+    pool.parallelFor(pool.tileCount(height), [&](int tile, int){
+        encodeBMPRows(pool.tileStart(tile), pool.tileEnd(tile, height), width, context.mapped.data(), output,
+                      outputStride);
+    });
+
+    return logAvgLuminance;
+}
+
+TonemapStatus tonemapMap(TonemapContext* context, const TonemapImage* input, const TonemapParams* params,
+                         uint8_t* output, size_t outputStride, float* logAverage){
+    if(context == nullptr)
+        return TONEMAP_INVALID_ARGUMENT;
+    TonemapStatus status = checkArguments(input, params, output, outputStride);
+    if(status != TONEMAP_OK)
+        return status;
+
+    try {
+        float logAvgLuminance;
+        if(params->useLUT)
+            logAvgLuminance = toneMapLUT(static_cast<const uint8_t*>(input->data), input->stride, output, outputStride,
+                                         input->width, input->height, params->exposureKey, context->pool);
+        else
+            logAvgLuminance = mapPlanar(*context, *input, *params, output, outputStride);
+
+        if(logAverage != nullptr)
+            *logAverage = logAvgLuminance;
+    }
+    catch(const std::bad_alloc&){
+        return TONEMAP_OUT_OF_MEMORY;
+    }
+    return TONEMAP_OK;
+}
+
+const char* tonemapStatusString(TonemapStatus status){
+    switch(status){
+        case TONEMAP_OK:               return "ok";
+        case TONEMAP_INVALID_ARGUMENT: return "invalid argument";
+        case TONEMAP_UNSUPPORTED:      return "unsupported combination of input and parameters";
+        case TONEMAP_OUT_OF_MEMORY:    return "out of memory";
+        case TONEMAP_SYSTEM_ERROR:     return "cannot start worker threads";
+    }
+    return "unknown status";
+}
@@ -0,0 +1,85 @@
+#ifndef TONEMAP_H
+#define TONEMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// libtonemap: the tone mapper as an in-memory library. Images go in and out as strided buffers,
+// nothing touches the disk, and every failure is returned as a TonemapStatus (the library never
+// calls exit()). A context owns the thread pool and the scratch planes, which are kept between
+// calls, so a service should create one context per concurrent caller and reuse it.
+//
+// Threading: a context is not reentrant; one thread at a time may call tonemapMap() on it. Distinct
+// contexts may map concurrently. The Reinhard kernel, the sRGB transfer function and deterministic
+// mode are process-wide settings of the command line tool (selectReinhardKernel(),
+// selectTransferFunction(), selectDeterministicMode() in tone.h); the library only reads them and
+// uses their defaults: the best kernel for the CPU, linear 8-bit values and the float log sum. They
+// are not synchronized, so a program linking the library must not change them while any context
+// is mapping.
+//
+// Build: the in-memory sources only (see README.txt), none of which calls exit():
+//   g++ -O2 -pthread -c tonemap.cpp toneCore.cpp threadPool.cpp reinhardKernels.cpp toneLUT.cpp
+//       toneOperators.cpp toneExposure.cpp toneCache.cpp srgbTransfer.cpp toneDeterministic.cpp
+//   ar rcs libtonemap.a tonemap.o toneCore.o ... toneDeterministic.o
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    TONEMAP_OK = 0,
+    TONEMAP_INVALID_ARGUMENT,   // null pointer, empty image, stride too small, negative key
+    TONEMAP_UNSUPPORTED,        // a combination the mapper does not implement, e.g. the LUT on float input
+    TONEMAP_OUT_OF_MEMORY,
+    TONEMAP_SYSTEM_ERROR        // the worker threads could not be started
+} TonemapStatus;
+
+typedef enum {
+    TONEMAP_FORMAT_BGR8,        // 3 bytes per pixel, B G R, like a 24-bit BMP row
+    TONEMAP_FORMAT_RGB32F       // 3 floats per pixel, R G B, linear and unbounded
+} TonemapFormat;
+
+typedef enum {
+    TONEMAP_OPERATOR_GLOBAL,    // L / (1 + L)
+    TONEMAP_OPERATOR_EXTENDED,  // L (1 + L / Lwhite^2) / (1 + L)
+    TONEMAP_OPERATOR_LOCAL      // dodge-and-burn over a range of Gaussian scales
+} TonemapOperator;
+
+typedef struct {
+    const void* data;
+    int width;
+    int height;
+    size_t stride;              // bytes from the start of one row to the next
+    TonemapFormat format;
+} TonemapImage;
+
+typedef struct {
+    float exposureKey;          // 0 = chosen from the luminance histogram
+    TonemapOperator toneOperator;
+    float whitePoint;           // extended operator only, 0 = the brightest pixel
+    int useLUT;                 // integer lookup-table path: BGR8 input and the global operator only
+} TonemapParams;
+
+typedef struct TonemapContext TonemapContext;
+
+// Key 0.18, global operator, float path.
+void tonemapDefaultParams(TonemapParams* params);
+
+// numThreads worker threads; 0 maps on the calling thread.
+TonemapStatus tonemapCreate(int numThreads, TonemapContext** context);
+void tonemapDestroy(TonemapContext* context);
+
+// Maps input into output, a BGR8 image of the same size with outputStride bytes per row. Rows keep
+// their order. output may be the input buffer if both are BGR8 with the same stride. The
+// log-average luminance is stored in *logAverage if it is not null. A context maps one image at a
+// time.
+TonemapStatus tonemapMap(TonemapContext* context, const TonemapImage* input, const TonemapParams* params,
+                         uint8_t* output, size_t outputStride, float* logAverage);
+
+const char* tonemapStatusString(TonemapStatus status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif